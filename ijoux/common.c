@@ -1,9 +1,14 @@
 #define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE    /* MAP_POPULATE, MADV_HUGEPAGE */
 #include <stdlib.h>
+#include <string.h>
 #include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <byteswap.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 # include <sys/time.h>
 #include <assert.h>
 
@@ -36,41 +41,71 @@ void *aligned_alloc(size_t alignment, size_t size)
 	return p;
 }
 
-void * load_file(const char *filename, u64 *size_)
+/* read-only view of a file, backed by the page cache (so that processes
+   reading the same file share it). On big-endian hosts, the mapping is
+   private and byte-swapped in place. Release it with unmap_file(). */
+const void * map_file(const char *filename, u64 *size_)
 {
-	/* obtain file size */
-        struct stat infos;
-        if (stat(filename, &infos))
-                err(1, "fstat failed on %s", filename);
-        u64 size = infos.st_size;
-        assert ((size % 8) == 0);
-        size /= 8;
-
-        /* allocate memory */
-        u64 *content = aligned_alloc(64, size * 8);
-        if (content == NULL)
-                err(1, "failed to allocate memory");
-        
-        /* read */
-        FILE *f = fopen(filename, "r");
-        if (f == NULL)
-                err(1, "fopen failed (%s)", filename);
-        u64 check = fread(content, 8, size, f);
-        if (check != size)
-                errx(1, "incomplete read %s", filename);
-        fclose(f);
-        *size_ = size;
-
-        /* byte-swap if necessary */
-        if (big_endian()) {
-                #pragma omp parallel for
-                for (u32 i = 0; i < size; i++)
-                        content[i] = bswap_64(content[i]);
-        }
-
-        return content;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		err(1, "open failed (%s)", filename);
+	struct stat infos;
+	if (fstat(fd, &infos))
+		err(1, "fstat failed on %s", filename);
+	u64 size = infos.st_size;
+	assert ((size % 8) == 0);
+	size /= 8;
+	*size_ = size;
+	if (size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	bool swap = big_endian();
+	int prot = swap ? PROT_READ | PROT_WRITE : PROT_READ;
+	int flags = swap ? MAP_PRIVATE : MAP_SHARED;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	u64 *content = mmap(NULL, size * 8, prot, flags, fd, 0);
+	if (content == MAP_FAILED)
+		err(1, "mmap failed (%s)", filename);
+	close(fd);
+
+	/* hints only: failures are harmless */
+#ifdef MADV_HUGEPAGE
+	madvise(content, size * 8, MADV_HUGEPAGE);
+#endif
+#ifndef MAP_POPULATE
+	posix_madvise(content, size * 8, POSIX_MADV_WILLNEED);
+#endif
+
+	if (swap) {
+		#pragma omp parallel for
+		for (u64 i = 0; i < size; i++)
+			content[i] = bswap_64(content[i]);
+		if (mprotect(content, size * 8, PROT_READ))
+			err(1, "mprotect failed (%s)", filename);
+	}
+	return content;
 }
 
+void unmap_file(const void *content, u64 size)
+{
+	if (size > 0 && munmap((void *) content, size * 8))
+		err(1, "munmap failed");
+}
+
+
+static struct solution_chunk_t *chunk_new()
+{
+	struct solution_chunk_t *chunk = malloc(sizeof(*chunk));
+	if (chunk == NULL)
+		err(1, "cannot allocate solution chunk");
+	chunk->next = NULL;
+	chunk->size = 0;
+	return chunk;
+}
 
 struct task_result_t *result_init()
 {
@@ -78,29 +113,69 @@ struct task_result_t *result_init()
 	if (result == NULL)
 		err(1, "cannot allocate task result object");
 	result->size = 0;
-	result->capacity = 128;
-	result->solutions =
-	    malloc(result->capacity * sizeof(struct solution_t));
+	result->first = chunk_new();
+	result->last = result->first;
 	return result;
 }
 
 void result_free(struct task_result_t *result)
 {
-	free(result->solutions);
+	struct solution_chunk_t *chunk = result->first;
+	while (chunk != NULL) {
+		struct solution_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
 	free(result);
 }
 
+/* forget the solutions, but keep the chunks */
+void result_clear(struct task_result_t *result)
+{
+	for (struct solution_chunk_t *chunk = result->first; chunk != NULL; chunk = chunk->next)
+		chunk->size = 0;
+	result->size = 0;
+	result->last = result->first;
+}
+
 void report_solution(struct task_result_t *result, const struct solution_t *sol)
 {
 	if ((sol->val[0] ^ sol->val[1] ^ sol->val[2]) != 0)
 		warnx("Fake solution reported");
-	if (result->size == result->capacity) {
-		result->solutions =
-		    realloc(result->solutions, 2 * result->capacity);
-		if (result->solutions == NULL)
-			err(1, "failed to re-alloc solutions array");
-		result->capacity *= 2;
+	struct solution_chunk_t *chunk = result->last;
+	if (chunk->size == SOLUTION_CHUNK_SIZE) {
+		if (chunk->next == NULL)
+			chunk->next = chunk_new();
+		chunk = chunk->next;
+		result->last = chunk;
 	}
-	result->solutions[result->size] = *sol;	          // struct copy
+	chunk->solutions[chunk->size] = *sol;	          // struct copy
+	chunk->size++;
 	result->size++;
 }
+
+/* move the solutions of src at the end of dst, without copying them. src is
+   left empty (with its spare chunks). */
+void result_merge(struct task_result_t *dst, struct task_result_t *src)
+{
+	if (src->size == 0)
+		return;
+	struct solution_chunk_t *spare = src->last->next;
+	src->last->next = dst->last->next;
+	dst->last->next = src->first;
+	dst->last = src->last;
+	dst->size += src->size;
+
+	src->first = (spare != NULL) ? spare : chunk_new();
+	src->last = src->first;
+	src->size = 0;
+}
+
+/* copy the solutions to out[0:result->size] */
+void result_flatten(const struct task_result_t *result, struct solution_t *out)
+{
+	for (const struct solution_chunk_t *chunk = result->first; chunk != NULL; chunk = chunk->next) {
+		memcpy(out, chunk->solutions, chunk->size * sizeof(*out));
+		out += chunk->size;
+	}
+}
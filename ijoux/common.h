@@ -4,9 +4,9 @@
 
 
 struct jtask_t {
-	u64 *L[2];
+	const u64 *L[2];
 	u64 n[2];
-	struct slice_t *slices;
+	const struct slice_t *slices;
 	u64 slices_size;        /* in u64, not in bytes */
 };
 
@@ -15,10 +15,35 @@ struct solution_t {
 	u64 task_index[3];
 };
 
+/* tuning parameters of iterated_joux_task */
+struct jtune_t {
+	u32 T_part, T_subj;	/* number of threads */
+	u32 p;			/* bits used in partitioning */
+	u32 K;			/* slices processed per pass over L */
+	const char *gemm;	/* GEMM engine (NULL = best available) */
+	const char *join;	/* join engine (NULL = best available) */
+	u32 slice_threads;	/* > 0: one slice per thread, phases single-threaded */
+	bool two_phase;		/* check join candidates in batches, not inline */
+	bool autotune;		/* sweep the above on the first slices */
+	bool verbose;
+	const char *perf;	/* append per-phase hardware counters to this JSON file */
+};
+
+/* Solutions are stored in a list of fixed-size chunks: appending never
+   moves them, and results can be merged by splicing chunks. Chunks after
+   last are empty spares (kept by result_clear() for reuse). */
+#define SOLUTION_CHUNK_SIZE 64
+
+struct solution_chunk_t {
+	struct solution_chunk_t *next;
+	u32 size;
+	struct solution_t solutions[SOLUTION_CHUNK_SIZE];
+};
+
 struct task_result_t {
 	u32 size;
-	u32 capacity;
-	struct solution_t *solutions;
+	struct solution_chunk_t *first;
+	struct solution_chunk_t *last;	/* where solutions are appended */
 };
 
 #define MAX(x, y) (((x) < (y)) ? (y) : (x))
@@ -40,10 +65,16 @@ long long usec();
 
 bool big_endian();
 void *aligned_alloc(size_t alignment, size_t size);
-void *load_file(const char *filename, u64 * size_);
+const void *map_file(const char *filename, u64 * size_);
+void unmap_file(const void *content, u64 size);
 struct task_result_t *result_init();
 void report_solution(struct task_result_t *result, const struct solution_t *solution);
+void result_clear(struct task_result_t *result);
+void result_merge(struct task_result_t *dst, struct task_result_t *src);
+void result_flatten(const struct task_result_t *result, struct solution_t *out);
 void result_free(struct task_result_t *result);
 
 /* the task processing function -- in joux_v3.c */
-struct task_result_t *iterated_joux_task(struct jtask_t *task, const u32 *task_index);
+void jtune_defaults(struct jtune_t *tune);
+struct task_result_t *iterated_joux_task(struct jtask_t *task, const u32 *task_index,
+					 const struct jtune_t *tune);
@@ -1,93 +1,167 @@
+#include <err.h>
 #include "../types.h"
 
-/* functions for hash tables of 256 elements */
+/* the batched AVX2 lookups need a compiler that can target AVX2 function
+   by function; they are selected at runtime */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CUCKOO_AVX2
+#include <immintrin.h>
+#endif
+
+/* functions for hash tables of 256 elements.
+
+   The cuckoo tables have 256 buckets of 2 slots, followed by a stash of
+   CM_STASH_SIZE slots for the items that could not be placed, and by the
+   positions of the two hash functions. Lookups look at 4 slots, plus the
+   stash in the (rare) tables that use it. If the stash overflows, the table
+   is rebuilt with other hash functions, so every lookup is O(1). */
 
 static const u32 CM_HASH_SIZE = 512; /* 4 Kbyte */
-static const u64 CM_HASH_MASK = 511;
+static const u64 CM_BUCKET_MASK = 255;
+static const u32 CM_STASH_SIZE = 8;
+static const u32 CM_SEED = 512 + 8;
+static const u32 CM_TABLE_SIZE = 512 + 8 + 1; /* slots + stash + seed */
 
-/* two hash functions especially optimized for BG/Q */
-static inline u64 H0(u64 x)
+/* two hash functions especially optimized for BG/Q (they give buckets):
+   8-bit windows of x, at the positions given by byte 0 (H0) and byte 1 (H1)
+   of the seed. The first choice is bits [0:8] and [16:24]. */
+static inline u64 H0(const u64 *H, u64 x)
 {
-    return x & CM_HASH_MASK;
+    return (x >> (H[CM_SEED] & 0xff)) & CM_BUCKET_MASK;
 }
 
-static inline u64 H1(u64 x)
+static inline u64 H1(const u64 *H, u64 x)
 {
-    return (x >> 16) & CM_HASH_MASK;
+    return (x >> (H[CM_SEED] >> 8)) & CM_BUCKET_MASK;
 }
 
-/* insert x into the H (hash table with linear probing) */
-static inline void linear_insert(u64 *H, u64 x)
+/* is x in the stash of H (cuckoo table)? Only needed when H[CM_HASH_SIZE] != 0 */
+static inline bool stash_lookup(const u64 *H, const u64 x)
 {
-    u64 h = H0(x);
-    while (H[h])
-        h = (h + 1) & CM_HASH_MASK;
-    H[h] = x;
+    bool found = false;
+    for (u32 i = 0; i < CM_STASH_SIZE; i++)
+        found |= (H[CM_HASH_SIZE + i] == x);
+    return found;
 }
 
-/* Does x belongs to H? (hash table with linear probing) */
-static inline bool linear_lookup(const u64 *H, const u64 x)
+/* Does x belongs to H? (cuckoo table) */
+static inline bool cuckoo_lookup(const u64 *H, const u64 x)
 {
-    u64 h = H0(x);
-    while (1) {
-        u64 probe = H[h];
-        h = (h + 1) & CM_HASH_MASK;
-        if (probe == x)
-            return true;
-        if (probe == 0)
-            return false;
+    const u64 *b1 = H + 2 * H0(H, x);
+    const u64 *b2 = H + 2 * H1(H, x);
+    /* Goddamn xlc: DON'T USE  (probe1 == x) | (probe2 == x) */
+    if ((b1[0] == x) || (b1[1] == x) || (b2[0] == x) || (b2[1] == x))
+        return true;
+    return (H[CM_HASH_SIZE] != 0) && stash_lookup(H, x);
+}
+
+/* Which of x[0:n] belong to H (cuckoo table)? Bit i of the result is set
+   iff x[i] does. n <= 8. */
+static inline u32 cuckoo_lookup_many_scalar(const u64 *H, const u64 *x, u32 n)
+{
+    u32 mask = 0;
+    for (u32 i = 0; i < n; i++)
+        mask |= ((u32) cuckoo_lookup(H, x[i])) << i;
+    return mask;
+}
+
+#ifdef CUCKOO_AVX2
+/* same, 4 items at a time, with the 4 slots gathered at once */
+__attribute__ ((target("avx2")))
+static inline u32 cuckoo_lookup_many_avx2(const u64 *H, const u64 *x, u32 n)
+{
+    const __m256i mask = _mm256_set1_epi64x(CM_BUCKET_MASK);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i lanes = _mm256_set_epi64x(3, 2, 1, 0);
+    const __m128i s0 = _mm_cvtsi64_si128(H[CM_SEED] & 0xff);
+    const __m128i s1 = _mm_cvtsi64_si128(H[CM_SEED] >> 8);
+    const long long *T = (const long long *) H;
+    u32 result = 0;
+    for (u32 i = 0; i < n; i += 4) {
+        __m256i valid = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - i), lanes);
+        __m256i X = _mm256_maskload_epi64((const long long *) (x + i), valid);
+        __m256i h0 = _mm256_slli_epi64(_mm256_and_si256(_mm256_srl_epi64(X, s0), mask), 1);
+        __m256i h1 = _mm256_slli_epi64(_mm256_and_si256(_mm256_srl_epi64(X, s1), mask), 1);
+        __m256i p0 = _mm256_i64gather_epi64(T, h0, 8);
+        __m256i p1 = _mm256_i64gather_epi64(T, _mm256_add_epi64(h0, one), 8);
+        __m256i p2 = _mm256_i64gather_epi64(T, h1, 8);
+        __m256i p3 = _mm256_i64gather_epi64(T, _mm256_add_epi64(h1, one), 8);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi64(p0, X), _mm256_cmpeq_epi64(p1, X));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi64(p2, X));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi64(p3, X));
+        hit = _mm256_and_si256(hit, valid);
+        result |= _mm256_movemask_pd(_mm256_castsi256_pd(hit)) << i;
     }
+    if (H[CM_HASH_SIZE] != 0)
+        for (u32 i = 0; i < n; i++)
+            result |= ((u32) stash_lookup(H, x[i])) << i;
+    return result;
 }
+#endif
 
-/* Does x belongs to H? (hash table with linear probing) */
-static inline bool cuckoo_lookup(const u64 *H, const u64 x)
+typedef u32 (*cuckoo_lookup_many_t)(const u64 *H, const u64 *x, u32 n);
+
+/* the best batched lookup for this CPU. Resolve it once (at setup), not
+   on each batch */
+static inline cuckoo_lookup_many_t cuckoo_lookup_many_select()
 {
-    const u64 h1 = H0(x);
-    const u64 h2 = H1(x);
-    const u64 probe1 = H[h1];
-    const u64 probe2 = H[h2];
-    /* Goddamn xlc: DON'T USE  (probe1 == x) | (probe2 == x) */
-    return (probe1 == x) || (probe2 == x);
+#ifdef CUCKOO_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return cuckoo_lookup_many_avx2;
+#endif
+    return cuckoo_lookup_many_scalar;
 }
 
-/* try to insert x into H (cuckoo table). Returns TRUE in case of success */
+/* try to insert x into H (cuckoo table), evicting items from full buckets
+   and stashing the last one if that fails. Returns TRUE in case of success */
 static inline bool cuckoo_insert(u64 *H, u64 x)
 {
-    u64 h = H0(x);
+    u64 h = H0(H, x);
     for (u64 loops = 0; loops < 2*CM_HASH_SIZE; loops++) {
-        u64 y = x; x = H[h]; H[h] = y;
-        u64 h0 = H0(x);
-        u64 h1 = H1(x);
-        if (x == 0)
-            return true;
-        h = (h0 == h) ? h1 : h0;
+        u64 h0 = H0(H, x);
+        u64 h1 = H1(H, x);
+        for (u32 j = 0; j < 2; j++) {
+            if (H[2 * h0 + j] == 0) {
+                H[2 * h0 + j] = x;
+                return true;
+            }
+            if (H[2 * h1 + j] == 0) {
+                H[2 * h1 + j] = x;
+                return true;
+            }
+        }
+        /* both buckets are full: kick an item out of bucket h */
+        u64 slot = 2 * h + (loops & 1);
+        u64 y = H[slot]; H[slot] = x; x = y;
+        h = (H0(H, x) == h) ? H1(H, x) : H0(H, x);
     }
+    for (u32 i = 0; i < CM_STASH_SIZE; i++)
+        if (H[CM_HASH_SIZE + i] == 0) {
+            H[CM_HASH_SIZE + i] = x;
+            return true;
+        }
     return false;
 }
 
-/* tries to build a cuckoo table; in case of failure, builds a linear table */
-static bool cuckoo_build(const u64 *  L, u32 lo, u32 hi, u64 *H)
+/* builds a cuckoo table (CM_TABLE_SIZE slots) holding L[lo:hi], whose items
+   have at most width significant bits. When the stash overflows, the hash
+   windows are moved (H1 16 bits above H0, then 8 bits above) and the table
+   is rebuilt. Returns the number of rebuilds. Beyond about 450 items (90%
+   load), no choice works; slices hold far fewer. */
+static inline u32 cuckoo_build(const u64 *  L, u32 lo, u32 hi, u32 width, u64 *H)
 {
-    bool fail = false;
-    for (u32 i = 0; i < CM_HASH_SIZE; i++) 
-        H[i] = 0;
-    for (u32 i = lo; i < hi; i++) {
-        /*if (L[i] == 0)
-            errx(1, "cannot insert 0 in hash table"); */
-        if (!cuckoo_insert(H, L[i])) { 
-            fail = true;
-            break;
-        }
-    }
-
-    if (fail) {
-            for (u32 i = 0; i < CM_HASH_SIZE; i++) 
+    u32 rebuilds = 0;
+    for (u32 gap = 16; gap >= 8; gap -= 8)
+        for (u32 s0 = 0; s0 + gap + 8 <= width; s0 += 4) {
+            for (u32 i = 0; i < CM_TABLE_SIZE; i++)
                 H[i] = 0;
-        for (u32 i = lo; i < hi; i++) {
-            /*if (L[i] == 0)
-                errx(1, "cannot insert 0 in hash table");*/
-            linear_insert(H, L[i]);
+            H[CM_SEED] = s0 | ((s0 + gap) << 8);
+            bool ok = true;
+            for (u32 i = lo; i < hi && ok; i++)
+                ok = cuckoo_insert(H, L[i]);
+            if (ok)
+                return rebuilds;
+            rebuilds++;
         }
-    }
-    return fail;
-}
\ No newline at end of file
+    errx(1, "cannot build a cuckoo table on %d items of %d bits", hi - lo, width);
+}
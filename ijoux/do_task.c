@@ -15,10 +15,24 @@ void usage()
 	printf("--i=I --j=J             Solve task (i, j) given in HEXADECIMAL\n");
 	printf("--n=N                   Solve the first N tasks\n");
 	printf("--hash-dir=PATH         Location of hash files\n");
-	printf("--slice-dir=PATH        Location of slice files\n\n");
+	printf("--slice-dir=PATH        Location of slice files\n");
+	printf("--part-threads=T        Threads for GEMM + partitioning\n");
+	printf("--subjoin-threads=T     Threads for subjoins and checks\n");
+	printf("--part-bits=P           Use 2**P partitions\n");
+	printf("--slices-per-pass=K     Process K slices per pass over the hash lists\n");
+	printf("--gemm=NAME             GEMM engine (default: best available)\n");
+	printf("--join=NAME             Join engine (default: best available)\n");
+	printf("--slice-threads=T       T threads, each processing whole slices. Each thread\n");
+	printf("                        partitions all of A and B: 8*K bytes (+ slack) per item\n");
+	printf("--two-phase             Buffer join candidates before checking them (debug)\n");
+	printf("--autotune              Sweep the above on the first slices of each task\n");
+	printf("                        (not with --slice-threads)\n");
+	printf("--verbose               Per-task breakdown\n");
+	printf("--perf=FILE             Append per-phase hardware counters (JSON) to FILE\n\n");
 }
 
-void do_task(const char *hash_dir, const char  *slice_dir, u32 i, u32 j)
+void do_task(const char *hash_dir, const char  *slice_dir, u32 i, u32 j,
+	     const struct jtune_t *tune)
 {
 	printf("[%04x ; %04x ; %04x] ", i, j, i^j);
 	fflush(stdout);
@@ -29,12 +43,12 @@ void do_task(const char *hash_dir, const char  *slice_dir, u32 i, u32 j)
 		char filename[255];
 		char *kind_name[3] = {"foo", "bar", "foobar"};
 		sprintf(filename, "%s/%s.%03x", hash_dir, kind_name[k], idx[k]);
-		task.L[k] = load_file(filename, &task.n[k]);
+		task.L[k] = map_file(filename, &task.n[k]);
 	}
 
 	char filename[255];
 	sprintf(filename, "%s/%03x", slice_dir, idx[2]);
-	task.slices = load_file(filename, &task.slices_size);
+	task.slices = map_file(filename, &task.slices_size);
 
 	/* Now, random permutation is done during preprocessing
 	#pragma omp parallel for schedule(static)
@@ -48,33 +62,45 @@ void do_task(const char *hash_dir, const char  *slice_dir, u32 i, u32 j)
 	*/
 
 	double start = wtime();
-	struct task_result_t *result = iterated_joux_task(&task, idx);
+	struct task_result_t *result = iterated_joux_task(&task, idx, tune);
 	printf("%.2fs\n", wtime() - start);
 
 	if (result->size > 0) {
 		printf("#solutions = %d\n", result->size);
-		for (u32 u = 0; u < result->size; u++) {
-			struct solution_t * sol = &result->solutions[u];
-			printf("%016" PRIx64 " ^ %016" PRIx64 " ^ %016" PRIx64 " == 0\n",
-					sol->val[0], sol->val[1], sol->val[2]);
-		}
+		for (struct solution_chunk_t *chunk = result->first; chunk != NULL; chunk = chunk->next)
+			for (u32 u = 0; u < chunk->size; u++) {
+				struct solution_t * sol = &chunk->solutions[u];
+				printf("%016" PRIx64 " ^ %016" PRIx64 " ^ %016" PRIx64 " == 0\n",
+						sol->val[0], sol->val[1], sol->val[2]);
+			}
 	}
 
 	result_free(result);
-	free(task.L[0]);
-	free(task.L[1]);
-	free(task.slices);
+	unmap_file(task.L[0], task.n[0]);
+	unmap_file(task.L[1], task.n[1]);
+	unmap_file(task.slices, task.slices_size);
 }
 
 int main(int argc, char **argv)
 {	
 	/* parse command-line options */
-	struct option longopts[6] = {
+	struct option longopts[17] = {
 		{"i", required_argument, NULL, 'i'},
 		{"j", required_argument, NULL, 'j'},
 		{"n", required_argument, NULL, 'n'},
 		{"hash-dir", required_argument, NULL, 'h'},
 		{"slice-dir", required_argument, NULL, 's'},
+		{"part-threads", required_argument, NULL, 'T'},
+		{"subjoin-threads", required_argument, NULL, 'S'},
+		{"part-bits", required_argument, NULL, 'p'},
+		{"slices-per-pass", required_argument, NULL, 'K'},
+		{"gemm", required_argument, NULL, 'g'},
+		{"join", required_argument, NULL, 'J'},
+		{"slice-threads", required_argument, NULL, 't'},
+		{"two-phase", no_argument, NULL, '2'},
+		{"autotune", no_argument, NULL, 'a'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"perf", required_argument, NULL, 'f'},
 		{NULL, 0, NULL, 0}
 	};
 	u32 i = 0xffffffff;
@@ -82,6 +108,8 @@ int main(int argc, char **argv)
 	u32 n = 0xffffffff;
 	char *hash_dir = NULL;
 	char *slice_dir = NULL;
+	struct jtune_t tune;
+	jtune_defaults(&tune);
 	signed char ch;
 	while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
 		switch (ch) {
@@ -100,6 +128,39 @@ int main(int argc, char **argv)
 		case 's':
 			slice_dir = optarg;
 			break;
+		case 'T':
+			tune.T_part = atoi(optarg);
+			break;
+		case 'S':
+			tune.T_subj = atoi(optarg);
+			break;
+		case 'p':
+			tune.p = atoi(optarg);
+			break;
+		case 'K':
+			tune.K = atoi(optarg);
+			break;
+		case 'g':
+			tune.gemm = optarg;
+			break;
+		case 'J':
+			tune.join = optarg;
+			break;
+		case 't':
+			tune.slice_threads = atoi(optarg);
+			break;
+		case '2':
+			tune.two_phase = true;
+			break;
+		case 'a':
+			tune.autotune = true;
+			break;
+		case 'v':
+			tune.verbose = true;
+			break;
+		case 'f':
+			tune.perf = optarg;
+			break;
 		default:
 			errx(1, "Unknown option\n");
 		}
@@ -116,6 +177,10 @@ int main(int argc, char **argv)
 		usage();
 		errx(1, "Both i and j must be given.");
 	}
+	if (tune.slice_threads > 0 && tune.autotune) {
+		usage();
+		errx(1, "--autotune cannot be combined with --slice-threads");
+	}
 	if (hash_dir == NULL) {
 		usage();
 		errx(1, "missing option --hash-dir");
@@ -127,7 +192,7 @@ int main(int argc, char **argv)
 
 	double start = wtime();
 	if (n == 0xffffffff) {
-		do_task(hash_dir, slice_dir, i, j);
+		do_task(hash_dir, slice_dir, i, j, &tune);
 	} else {
 		u32 grid_size = pow(2, ceil(log2(n) / 2));
 		u32 k = 0;
@@ -136,7 +201,7 @@ int main(int argc, char **argv)
 			for (u32 j = 0; j < grid_size; j++) {
 				if (k == n)
 					break;
-				do_task(hash_dir, slice_dir, i, j);
+				do_task(hash_dir, slice_dir, i, j, &tune);
 				k++;
 			}
 	}
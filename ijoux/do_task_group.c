@@ -1,9 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include <err.h>
 #include <getopt.h>
 #include <byteswap.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <mpi.h>
 
@@ -22,31 +29,152 @@ struct task_result_t * iterated_joux_task_(struct jtask_t *task, u32 task_index[
 
 #define CPU_VERBOSE 0
 
-void *load_file_MPI(const char *filename, u64 * size, MPI_Comm comm)
+/* A file loaded on all ranks of a communicator, with one copy per node
+   (in an MPI shared-memory window). Loading is asynchronous:
+   shared_file_start() is collective but cheap. Then rank 0 of the
+   communicator reads the file on a helper thread, which makes no MPI calls,
+   and broadcasts it to the first rank of each node with MPI_Ibcast. The
+   caller meanwhile does something useful and calls shared_file_progress()
+   from time to time. shared_file_wait() completes the transfer.
+
+   Loaded files are cached by the job (see file_acquire()), with a
+   reference count: the task groups that share a file load it once. */
+struct shared_file_t {
+	int kind;		/* foo, bar or foobar */
+	u32 index;
+	int refcount;
+	char filename[255];
+	u64 size;
+	u64 *content;
+	MPI_Comm comm;		/* ranks that need the file */
+	MPI_Comm node;		/* ranks of comm on this node */
+	MPI_Comm leaders;	/* first rank on each node (MPI_COMM_NULL otherwise) */
+	MPI_Win win;		/* holds the content. Free with MPI_Win_free */
+	bool root;
+	bool posted;		/* has the Ibcast been posted? */
+	bool ready;		/* has the transfer completed? */
+	atomic_bool read_done;	/* set by the reader thread (root only) */
+	pthread_t reader;
+	MPI_Request request;
+};
+
+static void * shared_file_read(void *arg)
 {
-	int rank;
-	u64 *content = NULL;
+	struct shared_file_t *f = arg;
+	u64 size;
+	const u64 *mapped = map_file(f->filename, &size);
+	if (size != f->size)
+		errx(1, "%s changed size while being loaded", f->filename);
+	memcpy(f->content, mapped, size * 8);
+	unmap_file(mapped, size);
+	atomic_store(&f->read_done, true);
+	return NULL;
+}
 
+/* takes ownership of comm */
+static void shared_file_start(struct shared_file_t *f, const char *filename, MPI_Comm comm)
+{
+	int rank, node_rank;
 	MPI_Comm_rank(comm, &rank);
+	snprintf(f->filename, sizeof(f->filename), "%s", filename);
+	f->comm = comm;
+	f->root = (rank == 0);
+	f->posted = false;
+	f->ready = false;
+	atomic_init(&f->read_done, false);
 
-	if (rank == 0)   // load the file
-		content = load_file(filename, size);
-	
 	/* broadcast its size */
-	MPI_Bcast(size, 1, MPI_UINT64_T, 0, comm);
-	
-	if (rank != 0) {
-		content = aligned_alloc(64, *size * 8);
-		if (content == NULL)
-			err(1, "failed to allocate memory (non-root)");
+	if (f->root) {
+		struct stat infos;
+		if (stat(filename, &infos))
+			err(1, "stat failed on %s", filename);
+		f->size = infos.st_size / 8;
+	}
+	MPI_Bcast(&f->size, 1, MPI_UINT64_T, 0, comm);
+
+	/* allocate one copy per node (rank 0 is the first rank on its node) */
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &f->node);
+	MPI_Comm_rank(f->node, &node_rank);
+	MPI_Comm_split(comm, (node_rank == 0) ? 0 : MPI_UNDEFINED, rank, &f->leaders);
+	MPI_Aint bytes = (node_rank == 0) ? f->size * 8 : 0;
+	if (MPI_Win_allocate_shared(bytes, 8, MPI_INFO_NULL, f->node, &f->content, &f->win) != MPI_SUCCESS)
+		errx(1, "failed to allocate shared memory for %s", filename);
+	if (node_rank != 0) {
+		MPI_Aint devnull;
+		int disp_unit;
+		MPI_Win_shared_query(f->win, 0, &devnull, &disp_unit, &f->content);
 	}
 
-	/* broadcast its content */
-	MPI_Bcast(content, *size, MPI_UINT64_T, 0, comm);
+	/* the other leaders can wait for the content right away */
+	if (f->root) {
+		if (pthread_create(&f->reader, NULL, shared_file_read, f))
+			errx(1, "cannot start reader thread");
+	} else if (f->leaders != MPI_COMM_NULL) {
+		MPI_Ibcast(f->content, f->size, MPI_UINT64_T, 0, f->leaders, &f->request);
+		f->posted = true;
+	}
+}
 
-	return content;
+/* post the broadcast once the file has been read (root only) */
+static void shared_file_post(struct shared_file_t *f)
+{
+	if (pthread_join(f->reader, NULL))
+		errx(1, "cannot join reader thread");
+	MPI_Ibcast(f->content, f->size, MPI_UINT64_T, 0, f->leaders, &f->request);
+	f->posted = true;
 }
 
+static void shared_file_progress(struct shared_file_t *f)
+{
+	if (f->ready || f->leaders == MPI_COMM_NULL)
+		return;
+	if (!f->posted) {
+		if (!atomic_load(&f->read_done))
+			return;
+		shared_file_post(f);
+	}
+	int flag;
+	MPI_Test(&f->request, &flag, MPI_STATUS_IGNORE);
+}
+
+static const u64 * shared_file_wait(struct shared_file_t *f)
+{
+	if (f->ready)
+		return f->content;
+	if (f->leaders != MPI_COMM_NULL) {
+		if (!f->posted)
+			shared_file_post(f);
+		MPI_Wait(&f->request, MPI_STATUS_IGNORE);
+	}
+	MPI_Win_fence(0, f->win);
+	f->ready = true;
+	return f->content;
+}
+
+static void shared_file_free(struct shared_file_t *f)
+{
+	MPI_Win_free(&f->win);
+	if (f->leaders != MPI_COMM_NULL)
+		MPI_Comm_free(&f->leaders);
+	MPI_Comm_free(&f->node);
+	MPI_Comm_free(&f->comm);
+	free(f);
+}
+
+
+/* the foo, bar and foobar files of a task group, loaded in the background */
+struct tg_data_t {
+	int tg_i;
+	int tg_j;
+	struct shared_file_t *file[3];
+	struct jtask_t *all_tasks;
+};
+
+static const char *tg_kind_name[3] = {"foo", "bar", "foobar"};
+
+/* at most two task groups are loaded at once */
+#define FILE_CACHE_SIZE 6
+
 
 struct tg_context_t {
 	int task_grid_size;
@@ -58,28 +186,36 @@ struct tg_context_t {
 	int rank;
 	int comm_size;
 	char *input_dir;
-	void * data[3];
+	struct jtune_t tune;
+	struct shared_file_t *files[FILE_CACHE_SIZE];	/* loaded files */
+	int files_loaded;
+	int files_reused;
+	bool steal;		/* steal tasks from other ranks when done? */
+	MPI_Win counters;	/* next task of each rank (one int per rank) */
+	int tasks_stolen;
+	FILE *journal;		/* tasks done by this rank in the current task group */
 };
 
 
-static void tg_task_base(struct tg_context_t *ctx, int tg_i, int tg_j, u32 base[3])
+/* indices of the files of rank owner */
+static void tg_task_base(struct tg_context_t *ctx, int owner, int tg_i, int tg_j, u32 base[3])
 {
-	base[0] = tg_i * ctx->cpu_grid_size + ctx->cpu_i;
-	base[1] = tg_j * ctx->cpu_grid_size + ctx->cpu_j;
+	base[0] = tg_i * ctx->cpu_grid_size + owner / ctx->cpu_grid_size;
+	base[1] = tg_j * ctx->cpu_grid_size + owner % ctx->cpu_grid_size;
 	base[2] = base[0] ^ base[1];
 }
 
 
-static void tg_task_idx(struct tg_context_t *ctx, int tg_i, int tg_j, int task_i, int task_j, u32 idx[3])
+static void tg_task_idx(struct tg_context_t *ctx, int owner, int tg_i, int tg_j, int task_i, int task_j, u32 idx[3])
 {
-	tg_task_base(ctx, tg_i, tg_j, idx);
+	tg_task_base(ctx, owner, tg_i, tg_j, idx);
 	idx[0] = idx[0] * ctx->per_core_grid_size + task_i;
 	idx[1] = idx[1] * ctx->per_core_grid_size + task_j;
 	idx[2] = idx[0] ^ idx[1];
 }
 
 
-struct option longopts[11] = {
+struct option longopts[23] = {
 	{"task-grid-size", required_argument, NULL, 'b'},
 	{"tg-per-job", required_argument, NULL, 'g'},
 	{"input-dir", required_argument, NULL, 'h'},
@@ -89,6 +225,18 @@ struct option longopts[11] = {
 	{"i", required_argument, NULL, 'i'},
 	{"j", required_argument, NULL, 'j'},
 	{"job", required_argument, NULL, 'o'},
+	{"part-threads", required_argument, NULL, 'T'},
+	{"subjoin-threads", required_argument, NULL, 'S'},
+	{"part-bits", required_argument, NULL, 'P'},
+	{"slices-per-pass", required_argument, NULL, 'K'},
+	{"gemm", required_argument, NULL, 'G'},
+	{"join", required_argument, NULL, 'J'},
+	{"slice-threads", required_argument, NULL, 'x'},
+	{"two-phase", no_argument, NULL, '2'},
+	{"autotune", no_argument, NULL, 'a'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"no-steal", no_argument, NULL, 'n'},
+	{"perf", required_argument, NULL, 'f'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -118,6 +266,13 @@ struct tg_context_t * setup(int argc, char **argv, int *i, int *j, int *job)
         ctx->rank = rank;
         ctx->comm_size = world_size;
         ctx->input_dir = NULL;
+	for (int u = 0; u < FILE_CACHE_SIZE; u++)
+		ctx->files[u] = NULL;
+	ctx->files_loaded = 0;
+	ctx->files_reused = 0;
+	ctx->steal = true;
+	ctx->tasks_stolen = 0;
+	jtune_defaults(&ctx->tune);
 	*i = -1;
 	*j = -1;
 	*job = -1;
@@ -149,6 +304,42 @@ struct tg_context_t * setup(int argc, char **argv, int *i, int *j, int *job)
                 case 'o':
                         *job = atol(optarg);
                         break;
+                case 'T':
+                        ctx->tune.T_part = atol(optarg);
+                        break;
+                case 'S':
+                        ctx->tune.T_subj = atol(optarg);
+                        break;
+                case 'P':
+                        ctx->tune.p = atol(optarg);
+                        break;
+                case 'K':
+                        ctx->tune.K = atol(optarg);
+                        break;
+                case 'G':
+                        ctx->tune.gemm = optarg;
+                        break;
+                case 'J':
+                        ctx->tune.join = optarg;
+                        break;
+                case 'x':
+                        ctx->tune.slice_threads = atol(optarg);
+                        break;
+                case '2':
+                        ctx->tune.two_phase = true;
+                        break;
+                case 'a':
+                        ctx->tune.autotune = true;
+                        break;
+                case 'v':
+                        ctx->tune.verbose = true;
+                        break;
+                case 'n':
+                        ctx->steal = false;
+                        break;
+                case 'f':
+                        ctx->tune.perf = optarg;
+                        break;
                 default:
                         errx(1, "Unknown option\n");
                 }
@@ -161,6 +352,8 @@ struct tg_context_t * setup(int argc, char **argv, int *i, int *j, int *job)
 		errx(1, "missing --per-core-grid-size");
 	if (ctx->input_dir == NULL)
 		errx(1, "missing --input-dir");
+	if (ctx->tune.slice_threads > 0 && ctx->tune.autotune)
+		errx(1, "--autotune cannot be combined with --slice-threads");
 
 	if (world_size != ctx->cpu_grid_size * ctx->cpu_grid_size)
 		errx(2, "wrong communicator size (MPI says %d, I wanted %d)", world_size, ctx->cpu_grid_size * ctx->cpu_grid_size);
@@ -184,107 +377,357 @@ struct tg_context_t * setup(int argc, char **argv, int *i, int *j, int *job)
 	/* my own coordinates in the CPU grid */
 	ctx->cpu_i = rank / ctx->cpu_grid_size;
 	ctx->cpu_j = rank % ctx->cpu_grid_size;
+
+	/* one hardware counters file per rank */
+	if (ctx->tune.perf != NULL) {
+		char *filename = malloc(strlen(ctx->tune.perf) + 16);
+		if (filename == NULL)
+			err(1, "cannot allocate filename");
+		sprintf(filename, "%s.%d", ctx->tune.perf, rank);
+		ctx->tune.perf = filename;
+	}
+
+	/* task counters, accessed in a passive-target epoch that lasts until the end */
+	int *counter;
+	MPI_Win_allocate(sizeof(int), sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &counter, &ctx->counters);
+	*counter = 0;
+	MPI_Win_lock_all(0, ctx->counters);
 	return ctx;
 }
 
 
-static struct jtask_t * load_tg_data(struct tg_context_t *ctx, int tg_i, int tg_j)
+/* get the file (kind, index), from the cache or by loading it. Collective:
+   all ranks must agree on whether it is cached (for foobar files, this may
+   not be the case), otherwise they all load it again. */
+static struct shared_file_t * file_acquire(struct tg_context_t *ctx, int kind, u32 index)
 {
+	struct shared_file_t *f = NULL;
+	int free_slot = -1;
+	for (int u = 0; u < FILE_CACHE_SIZE; u++) {
+		if (ctx->files[u] == NULL)
+			free_slot = u;
+		else if (ctx->files[u]->kind == kind && ctx->files[u]->index == index)
+			f = ctx->files[u];
+	}
+	int hit = (f != NULL);
+	int all_hit;
+	MPI_Allreduce(&hit, &all_hit, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+	if (all_hit) {
+		f->refcount++;
+		ctx->files_reused++;
+		return f;
+	}
+
+	if (free_slot < 0)
+		errx(1, "file cache is full");
+	f = malloc(sizeof(*f));
+	if (f == NULL)
+		err(1, "cannot allocate file");
+	f->kind = kind;
+	f->index = index;
+	f->refcount = 1;
+	ctx->files[free_slot] = f;
+	ctx->files_loaded++;
+
 	char filename[255];
+	MPI_Comm comm;
+	sprintf(filename, "%s/%s.%03x", ctx->input_dir, tg_kind_name[kind], index);
+	MPI_Comm_split(MPI_COMM_WORLD, index, 0, &comm);
+	shared_file_start(f, filename, comm);
+	return f;
+}
+
+/* evict the file from the cache when it is no longer referenced. All ranks
+   release their files in the same order, so that MPI_Win_free matches. */
+static void file_release(struct tg_context_t *ctx, struct shared_file_t *f)
+{
+	if (--f->refcount > 0)
+		return;
+	for (int u = 0; u < FILE_CACHE_SIZE; u++)
+		if (ctx->files[u] == f)
+			ctx->files[u] = NULL;
+	shared_file_wait(f);
+	shared_file_free(f);
+}
+
+/* start loading the data of a task group. Collective. */
+static void tg_load_start(struct tg_context_t *ctx, int tg_i, int tg_j, struct tg_data_t *data)
+{
 	u32 base[3];
-	MPI_Comm comm_I, comm_J, comm_IJ;
-	u64 devnull;
 
+	data->tg_i = tg_i;
+	data->tg_j = tg_j;
+	tg_task_base(ctx, ctx->rank, tg_i, tg_j, base);
+	for (int k = 0; k < 3; k++)
+		data->file[k] = file_acquire(ctx, k, base[k]);
+}
+
+/* let the transfers go on (data may be NULL) */
+static void tg_load_progress(struct tg_data_t *data)
+{
+	if (data == NULL)
+		return;
+	for (int k = 0; k < 3; k++)
+		shared_file_progress(data->file[k]);
+}
+
+/* describe the tasks found in a foo (k = 0), bar (k = 1) or foobar (k = 2) file */
+static void tg_describe(struct tg_context_t *ctx, int k, const u64 *X, struct jtask_t *all_tasks)
+{
+	if (X[0] != (u64) ctx->per_core_grid_size)
+		errx(4, "wrong task-group size (%s)", tg_kind_name[k]);
+	for (u64 r = 0; r < X[0]; r++) {
+		const u64 *start = X + X[r + 1];
+		u64 size = X[r + 2] - X[r + 1];
+		if (k < 2) {
+			all_tasks[r].L[k] = start;
+			all_tasks[r].n[k] = size;
+		} else {
+			all_tasks[r].slices = (const struct slice_t *) start;
+			all_tasks[r].slices_size = size;
+		}
+	}
+}
+
+/* finish loading the data of a task group and describe its tasks */
+static struct jtask_t * tg_load_wait(struct tg_context_t *ctx, struct tg_data_t *data)
+{
 	double start = MPI_Wtime();
 	struct jtask_t *all_tasks = malloc(ctx->per_core_grid_size * sizeof(*all_tasks));
-	tg_task_base(ctx, tg_i, tg_j, base);
-
-	/* A */
-	sprintf(filename, "%s/foo.%03x", ctx->input_dir, base[0]);
-	MPI_Comm_split(MPI_COMM_WORLD, base[0], 0, &comm_I);
-	u64 *A = load_file_MPI(filename, &devnull, comm_I);
-	if (A[0] != (u64) ctx->per_core_grid_size)
-		errx(4, "wrong task-group size (foo)");
-	for (u64 r = 0; r < A[0]; r++) {
-		all_tasks[r].L[0] = A + A[r + 1];
-		all_tasks[r].n[0] = A[r + 2] - A[r + 1];
-	}
-	ctx->data[0] = A;
-	MPI_Comm_free(&comm_I);
-
-	/* B */
-	sprintf(filename, "%s/bar.%03x", ctx->input_dir, base[1]);
-	MPI_Comm_split(MPI_COMM_WORLD, base[1], 0, &comm_J);	
-	u64 *B = load_file_MPI(filename, &devnull, comm_J);
-	if (B[0] != (u64) ctx->per_core_grid_size)
-		errx(4, "wrong task-group size (bar)");
-	for (u64 r = 0; r < B[0]; r++) {
-		all_tasks[r].L[1] = B + B[r + 1];
-		all_tasks[r].n[1] = B[r + 2] - B[r + 1];
-	}
-	ctx->data[1] = B;
-	MPI_Comm_free(&comm_J);
-
-	/* C */
-	sprintf(filename, "%s/foobar.%03x", ctx->input_dir, base[2]);
-	MPI_Comm_split(MPI_COMM_WORLD, base[2], 0, &comm_IJ);
-	u64 *C = load_file_MPI(filename, &devnull, comm_IJ);
-	if (C[0] != (u64) ctx->per_core_grid_size)
-		errx(4, "wrong task-group size (foobar)");
-        for (u64 r = 0; r < C[0]; r++) {
-	        all_tasks[r].slices = (struct slice_t *) (C + C[r + 1]);
-	        all_tasks[r].slices_size = C[r + 2] - C[r + 1];
-        }
-        ctx->data[2] = C;
-	MPI_Comm_free(&comm_IJ);
+	if (all_tasks == NULL)
+		err(1, "cannot allocate task descriptors");
+	for (int k = 0; k < 3; k++)
+		tg_describe(ctx, k, shared_file_wait(data->file[k]), all_tasks);
 
 	double end_load = MPI_Wtime();
 	if (ctx->rank == 0)
-		printf("Total data load time %.fs\n", end_load - start);
-	
+		printf("Waited for data: %.1fs\n", end_load - start);
 	
+	data->all_tasks = all_tasks;
 	return all_tasks;
 }
 
 
-static struct task_result_t * tg_task_work(struct tg_context_t *ctx, int tg_i, int tg_j, struct jtask_t *all_tasks)
+/* The data of another rank, mapped directly from the files (page cache)
+   when stealing its tasks. */
+struct stolen_t {
+	int owner;
+	const u64 *file[3];
+	u64 size[3];
+	struct jtask_t *all_tasks;
+};
+
+static void stolen_map(struct tg_context_t *ctx, int tg_i, int tg_j, int owner, struct stolen_t *victim)
 {
-	struct task_result_t *all_solutions = result_init();
-	double all_tasks_start = MPI_Wtime();
-	for (int r = 0; r < ctx->per_core_grid_size; r++) {
-	        for (int s = 0; s < ctx->per_core_grid_size; s++) {
-			/* build task descriptor */
-			struct jtask_t task;
-			u32 task_index[3];
-			tg_task_idx(ctx, tg_i, tg_j, r, s, task_index);
-			task.L[0] = all_tasks[r].L[0];
-			task.n[0] = all_tasks[r].n[0];
-			task.L[1] = all_tasks[s].L[1];
-			task.n[1] = all_tasks[s].n[1];
-			task.slices = all_tasks[r ^ s].slices;
-			task.slices_size = all_tasks[r ^ s].slices_size;
-
-			double task_start = MPI_Wtime();	
-			
-			if (CPU_VERBOSE) {
-				printf(" [%04x ; %04x ; %04x] : ", 
-					task_index[0], task_index[1], task_index[2]);
-			}
+	char filename[255];
+	u32 base[3];
+	tg_task_base(ctx, owner, tg_i, tg_j, base);
+	victim->owner = owner;
+	victim->all_tasks = malloc(ctx->per_core_grid_size * sizeof(*victim->all_tasks));
+	if (victim->all_tasks == NULL)
+		err(1, "cannot allocate task descriptors");
+	for (int k = 0; k < 3; k++) {
+		sprintf(filename, "%s/%s.%03x", ctx->input_dir, tg_kind_name[k], base[k]);
+		victim->file[k] = map_file(filename, &victim->size[k]);
+		tg_describe(ctx, k, victim->file[k], victim->all_tasks);
+	}
+}
 
+static void stolen_unmap(struct stolen_t *victim)
+{
+	for (int k = 0; k < 3; k++)
+		unmap_file(victim->file[k], victim->size[k]);
+	free(victim->all_tasks);
+	victim->owner = -1;
+}
 
-			struct task_result_t * result = iterated_joux_task(&task, task_index);
-		
-			if (CPU_VERBOSE)
-				printf("%.1fs; %d solutions\n", MPI_Wtime() - task_start, result->size);
-			
-			/* copy task solutions into global all_solutions array */
-			for (u32 u = 0; u < result->size; u++) {
-				struct solution_t * solution = &result->solutions[u];
-				report_solution(all_solutions, solution);		
+/* grab the next task of rank owner; returns -1 if there is none left */
+static int tg_next_task(struct tg_context_t *ctx, int owner)
+{
+	int one = 1;
+	int t;
+	MPI_Fetch_and_op(&one, &t, MPI_INT, owner, 0, MPI_SUM, ctx->counters);
+	MPI_Win_flush(owner, ctx->counters);
+	return (t < ctx->per_core_grid_size * ctx->per_core_grid_size) ? t : -1;
+}
+
+/* The journal of a rank lists the tasks it has done in the current task
+   group, with their solutions, so that they are not redone after a restart.
+   It is a sequence of records: a journal_entry_t followed by n solutions.
+   A truncated record at the end (crash while writing) is discarded.
+   Solutions are thus on disk as soon as their task is done, and the
+   journals can be read by post-processing while the job is running. */
+struct journal_entry_t {
+	u64 owner;
+	u64 task;
+	u64 n;
+};
+
+void tg_journal_filename(int tg_i, int tg_j, int rank, char *filename)
+{
+	sprintf(filename, "journal_%02x_%02x.%d", tg_i, tg_j, rank);
+}
+
+static void tg_print_solution(const struct solution_t *solution)
+{
+	printf("[%04" PRIx64 ";%04" PRIx64 ";%04" PRIx64 "] %016" PRIx64 " ^ %016" PRIx64 " ^ %016" PRIx64 " == 0\n", 
+		solution->task_index[0], solution->task_index[1], solution->task_index[2],
+		solution->val[0], solution->val[1], solution->val[2]);
+}
+
+/* read my journal: mark the tasks it contains in done and collect their
+   solutions (they are shown again, as they would be by tg_do_task). Then
+   open it to append new records. */
+static void tg_journal_replay(struct tg_context_t *ctx, int tg_i, int tg_j, u8 *done,
+			      struct task_result_t *all_solutions)
+{
+	char filename[255];
+	tg_journal_filename(tg_i, tg_j, ctx->rank, filename);
+	long valid = 0;
+	FILE *f = fopen(filename, "r");
+	if (f != NULL) {
+		struct journal_entry_t entry;
+		while (fread(&entry, sizeof(entry), 1, f) == 1) {
+			if (entry.owner >= (u64) ctx->comm_size || entry.task >= (u64) ctx->per_core_grid_size * ctx->per_core_grid_size)
+				break;
+			struct solution_t *solutions = malloc(entry.n * sizeof(*solutions));
+			if (solutions == NULL)
+				err(1, "cannot allocate solutions");
+			if (fread(solutions, sizeof(*solutions), entry.n, f) != entry.n) {
+				free(solutions);
+				break;
+			}
+			for (u64 u = 0; u < entry.n; u++) {
+				tg_print_solution(&solutions[u]);
+				report_solution(all_solutions, &solutions[u]);
 			}
-                        result_free(result);
+			free(solutions);
+			done[entry.owner * ctx->per_core_grid_size * ctx->per_core_grid_size + entry.task] = 1;
+			valid = ftell(f);
+		}
+		fclose(f);
+		fflush(stdout);
+		if (truncate(filename, valid))
+			err(1, "cannot truncate %s", filename);
+	}
+	ctx->journal = fopen(filename, "a");
+	if (ctx->journal == NULL)
+		err(1, "fopen failed (%s)", filename);
+}
+
+/* make task t of rank owner durable in my journal */
+static void tg_journal_write(struct tg_context_t *ctx, int owner, int t, const struct task_result_t *result)
+{
+	struct journal_entry_t entry = {owner, t, result->size};
+	if (fwrite(&entry, sizeof(entry), 1, ctx->journal) != 1)
+		errx(1, "cannot write journal");
+	for (struct solution_chunk_t *chunk = result->first; chunk != NULL; chunk = chunk->next)
+		if (fwrite(chunk->solutions, sizeof(struct solution_t), chunk->size, ctx->journal) != chunk->size)
+			errx(1, "cannot write journal");
+	if (fflush(ctx->journal) || fsync(fileno(ctx->journal)))
+		err(1, "cannot sync journal");
+}
+
+/* do task t of rank owner, whose data is described in all_tasks */
+static void tg_do_task(struct tg_context_t *ctx, int owner, int tg_i, int tg_j, int t,
+		       const struct jtask_t *all_tasks, struct task_result_t *all_solutions)
+{
+	int r = t / ctx->per_core_grid_size;
+	int s = t % ctx->per_core_grid_size;
+
+	/* build task descriptor */
+	struct jtask_t task;
+	u32 task_index[3];
+	tg_task_idx(ctx, owner, tg_i, tg_j, r, s, task_index);
+	task.L[0] = all_tasks[r].L[0];
+	task.n[0] = all_tasks[r].n[0];
+	task.L[1] = all_tasks[s].L[1];
+	task.n[1] = all_tasks[s].n[1];
+	task.slices = all_tasks[r ^ s].slices;
+	task.slices_size = all_tasks[r ^ s].slices_size;
+
+	double task_start = MPI_Wtime();	
+	
+	if (CPU_VERBOSE) {
+		printf(" [%04x ; %04x ; %04x] : ", 
+			task_index[0], task_index[1], task_index[2]);
+	}
+
+
+	struct task_result_t * result = iterated_joux_task(&task, task_index, &ctx->tune);
+
+	if (CPU_VERBOSE)
+		printf("%.1fs; %d solutions\n", MPI_Wtime() - task_start, result->size);
+	
+	/* show task solutions now, then move them into all_solutions */
+	for (struct solution_chunk_t *chunk = result->first; chunk != NULL; chunk = chunk->next)
+		for (u32 u = 0; u < chunk->size; u++)
+			tg_print_solution(&chunk->solutions[u]);
+	fflush(stdout);
+	tg_journal_write(ctx, owner, t, result);
+	result_merge(all_solutions, result);
+        result_free(result);
+}
+
+
+/* do all the tasks of a task group, while loading the next one. Tasks are
+   handed out by per-rank counters (MPI one-sided), so that a rank done with
+   its own tasks can steal those of the others instead of waiting. */
+static struct task_result_t * tg_task_work(struct tg_context_t *ctx, int tg_i, int tg_j, struct jtask_t *all_tasks,
+					   struct tg_data_t *next)
+{
+	struct task_result_t *all_solutions = result_init();
+
+	/* which tasks are already done (by anyone)? */
+	int n_tasks = ctx->per_core_grid_size * ctx->per_core_grid_size;
+	u8 *done = calloc(ctx->comm_size * n_tasks, sizeof(*done));
+	if (done == NULL)
+		err(1, "cannot allocate task map");
+	tg_journal_replay(ctx, tg_i, tg_j, done, all_solutions);
+	MPI_Allreduce(MPI_IN_PLACE, done, ctx->comm_size * n_tasks, MPI_UINT8_T, MPI_BOR, MPI_COMM_WORLD);
+	if (ctx->rank == 0) {
+		int n_done = 0;
+		for (int u = 0; u < ctx->comm_size * n_tasks; u++)
+			n_done += done[u];
+		if (n_done > 0)
+			printf("Resuming: %d tasks already done\n", n_done);
+	}
+
+	/* reset my counter, and make sure nobody steals before that */
+	int zero = 0;
+	MPI_Accumulate(&zero, 1, MPI_INT, ctx->rank, 0, 1, MPI_INT, MPI_REPLACE, ctx->counters);
+	MPI_Win_flush(ctx->rank, ctx->counters);
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	double all_tasks_start = MPI_Wtime();
+	int t;
+	while ((t = tg_next_task(ctx, ctx->rank)) >= 0) {
+		if (done[ctx->rank * n_tasks + t])
+			continue;
+		tg_do_task(ctx, ctx->rank, tg_i, tg_j, t, all_tasks, all_solutions);
+		tg_load_progress(next);
+	}
+
+	/* steal */
+	int stolen = 0;
+	for (int v = 1; ctx->steal && v < ctx->comm_size; v++) {
+		struct stolen_t victim = { .owner = -1 };
+		int owner = (ctx->rank + v) % ctx->comm_size;
+		while ((t = tg_next_task(ctx, owner)) >= 0) {
+			if (done[owner * n_tasks + t])
+				continue;
+			if (victim.owner < 0)
+				stolen_map(ctx, tg_i, tg_j, owner, &victim);
+			tg_do_task(ctx, owner, tg_i, tg_j, t, victim.all_tasks, all_solutions);
+			tg_load_progress(next);
+			stolen++;
 		}
+		if (victim.owner >= 0)
+			stolen_unmap(&victim);
 	}
+	ctx->tasks_stolen += stolen;
+	free(done);
+	fclose(ctx->journal);
 	
 	/* synchronisation */
 	double barrier_start = MPI_Wtime();
@@ -292,8 +735,10 @@ static struct task_result_t * tg_task_work(struct tg_context_t *ctx, int tg_i, i
 	if (CPU_VERBOSE)
 		printf("Waited in BARRIER: %.1fs\n", MPI_Wtime() - barrier_start);
 
+	int total_stolen;
+	MPI_Reduce(&stolen, &total_stolen, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 	if (ctx->rank == 0)
-		printf("All tasks done: %.1fs\n", MPI_Wtime() - all_tasks_start);
+		printf("All tasks done: %.1fs (%d stolen)\n", MPI_Wtime() - all_tasks_start, total_stolen);
 
 	return all_solutions;
 }
@@ -303,90 +748,102 @@ void tg_solution_filename(int tg_i, int tg_j, char *filename)
 	sprintf(filename, "solutions_%02x_%02x.bin", tg_i, tg_j);
 }
 
-void tg_gather_and_save(struct tg_context_t * ctx, int tg_i, int tg_j, struct task_result_t * all_solutions)
+/* write the solutions of all ranks in the solution file with MPI-IO. Each
+   rank writes its own at its offset, so nothing goes through rank 0. */
+void tg_save(struct tg_context_t * ctx, int tg_i, int tg_j, struct task_result_t * all_solutions)
 {
-	/* gather solutions to node 0 */
 	double transmission_start = MPI_Wtime();
-	int *solutions_sizes = NULL;
-	int *displacements = NULL;
-	struct solution_t *solutions_recv = NULL;
-
-	// MPI_Gather sur un tableau de taille 1 : all_solutions->size;  [1 x MPI_UINT32_T]
-	if (ctx->rank == 0) 
-		solutions_sizes = malloc(sizeof(u32) * ctx->comm_size);
-	u32 u64_to_send = 6 * all_solutions->size;
-	MPI_Gather(&u64_to_send, 1, MPI_UINT32_T, solutions_sizes, 1, MPI_UINT32_T, 0, MPI_COMM_WORLD);
-
-	// MPI_Gatherv sur un tableau de taille 6 * all_solutions->size : all_solutions->solutions  [MPI_UINT64_T]
-	int d = 0;
-	if (ctx->rank == 0) {
-		displacements = malloc(sizeof(int) * ctx->comm_size);
-		for (int i = 0; i < ctx->comm_size; i++) {
-			displacements[i] = d;
-			d += solutions_sizes[i];
-		}
-		solutions_recv = malloc(sizeof(struct solution_t) * (d / 6));
-		printf("#solutions = %d\n", d / 6);
-	}
-	MPI_Gatherv(all_solutions->solutions, u64_to_send, MPI_UINT64_T, solutions_recv, 
-		solutions_sizes, displacements, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+	u64 mine = all_solutions->size;
+	u64 before = 0;
+	u64 total;
+	MPI_Exscan(&mine, &before, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+	if (ctx->rank == 0)
+		before = 0;	/* undefined on rank 0 */
+	MPI_Allreduce(&mine, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+	if (ctx->rank == 0)
+		printf("#solutions = %" PRId64 "\n", total);
 
-	/* If I'm rank zero, I save in a file */
+	/* write, then rename, so that a partial file is never taken for a checkpoint */
+	char filename[255], tmp_filename[260];
+	tg_solution_filename(tg_i, tg_j, filename);
+	sprintf(tmp_filename, "%s.tmp", filename);
+	MPI_File fh;
+	if (MPI_File_open(MPI_COMM_WORLD, tmp_filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+			  MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+		errx(1, "cannot open %s", tmp_filename);
+	MPI_File_set_size(fh, total * sizeof(struct solution_t));
+	MPI_Offset offset = before * sizeof(struct solution_t);
+	struct solution_t *solutions = malloc(MAX(1, mine) * sizeof(*solutions));
+	if (solutions == NULL)
+		err(1, "cannot allocate solutions");
+	result_flatten(all_solutions, solutions);
+	if (mine > INT_MAX)
+		errx(1, "too many solutions to write at once (%" PRId64 ")", mine);
+	MPI_Datatype solution_type;
+	MPI_Type_contiguous(sizeof(struct solution_t) / sizeof(u64), MPI_UINT64_T, &solution_type);
+	MPI_Type_commit(&solution_type);
+	if (MPI_File_write_at_all(fh, offset, solutions, mine,
+				  solution_type, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+		errx(1, "incomplete write %s", tmp_filename);
+	MPI_Type_free(&solution_type);
+	free(solutions);
+	MPI_File_sync(fh);
+	MPI_File_close(&fh);
 	if (ctx->rank == 0) {
-		free(solutions_sizes);
-		free(displacements);
-
-		char filename[255];
-		tg_solution_filename(tg_i, tg_j, filename);
-		FILE *f_solutions = fopen(filename, "w");
-		if (f_solutions == NULL)
-                	err(1, "fopen failed (%s)", filename);
-		int check = fwrite(solutions_recv, sizeof(struct solution_t), d / 6, f_solutions);
-		if (check != d / 6)
-	                errx(1, "incomplete write %s", filename);
-        	fclose(f_solutions);
-
-		if (ctx->rank == 0)
-			printf("Gathering and saving: %.1fs\n", MPI_Wtime() - transmission_start);
-		
-		for (int i = 0; i < d / 6; i++) 
-			printf("[%04" PRIx64 ";%04" PRIx64 ";%04" PRIx64 "] %016" PRIx64 " ^ %016" PRIx64 " ^ %016" PRIx64 " == 0\n", 
-				solutions_recv[i].task_index[0], solutions_recv[i].task_index[1], solutions_recv[i].task_index[2],
-				solutions_recv[i].val[0], solutions_recv[i].val[1], solutions_recv[i].val[2]);
-		free(solutions_recv);
+		if (rename(tmp_filename, filename))
+			err(1, "cannot rename %s", tmp_filename);
+		printf("Saving: %.1fs\n", MPI_Wtime() - transmission_start);
 	}
 }
 
 
-void tg_cleanup(struct tg_context_t * ctx, struct task_result_t * all_solutions)
+void tg_cleanup(struct tg_context_t * ctx, struct task_result_t * all_solutions, struct tg_data_t *data)
 {
 	result_free(all_solutions);
+	free(data->all_tasks);
 	for (int i = 0; i < 3; i++)
-		free(ctx->data[i]);
+		file_release(ctx, data->file[i]);
 }
 
 
-void do_task_group(struct tg_context_t * ctx, int tg_i, int tg_j)
+/* is the task group checkpointed? */
+bool tg_done(struct tg_context_t * ctx, int tg_i, int tg_j)
 {
-	/* check if checkpointed */
 	char filename[255];
 	tg_solution_filename(tg_i, tg_j, filename);
 	FILE *f_solutions = fopen(filename, "r");
-	if (f_solutions != NULL) {
-		/* solution file exists. SKIP ! */		
-		fclose(f_solutions);
-		if (ctx->rank == 0)
-			printf("SKIPPING task goup (%d, %d)\n", tg_i, tg_j);
-		return;
-	}
+	if (f_solutions == NULL)
+		return false;
+	/* solution file exists. SKIP ! */		
+	fclose(f_solutions);
+	if (ctx->rank == 0)
+		printf("SKIPPING task goup (%d, %d)\n", tg_i, tg_j);
+	return true;
+}
 
+
+/* process the task group whose data is being loaded in cur, while loading
+   the next one (if any) */
+void do_task_group(struct tg_context_t * ctx, struct tg_data_t *cur, struct tg_data_t *next, int next_i, int next_j)
+{
+	int tg_i = cur->tg_i;
+	int tg_j = cur->tg_j;
 	if (ctx->rank == 0)
 		printf("Doing task goup (%d, %d)\n", tg_i, tg_j);
 
-	struct jtask_t *all_tasks = load_tg_data(ctx, tg_i, tg_j);
-	struct task_result_t * all_solutions = tg_task_work(ctx, tg_i, tg_j, all_tasks);
-	tg_gather_and_save(ctx, tg_i, tg_j, all_solutions);
-	tg_cleanup(ctx, all_solutions);
+	struct jtask_t *all_tasks = tg_load_wait(ctx, cur);
+	if (next != NULL)
+		tg_load_start(ctx, next_i, next_j, next);
+	struct task_result_t * all_solutions = tg_task_work(ctx, tg_i, tg_j, all_tasks, next);
+	tg_save(ctx, tg_i, tg_j, all_solutions);
+
+	/* the solution file is written: the journals are no longer needed */
+	char filename[255];
+	MPI_Barrier(MPI_COMM_WORLD);
+	tg_journal_filename(tg_i, tg_j, ctx->rank, filename);
+	unlink(filename);
+
+	tg_cleanup(ctx, all_solutions, cur);
 }
 
 
@@ -406,27 +863,58 @@ void do_job(struct tg_context_t * ctx, int job)
 		printf("* #jobs           is %d\n", njobs);
 	}
 
+	/* task groups left to do, in snake order: consecutive ones share their
+	   foo file (same row), or their bar file (when changing rows) */
+	int *todo = malloc(ctx->tg_per_job * sizeof(*todo));
+	if (todo == NULL)
+		err(1, "cannot allocate job");
+	int n = 0;
 	for (int k = tg_from; k < tg_to; k++) {
 		int i = k / tg_grid_size;
-		int j = k % tg_grid_size;
+		int lo = MAX(tg_from, i * tg_grid_size);
+		int hi = MIN(tg_to, (i + 1) * tg_grid_size);
+		int kk = ((i - tg_from / tg_grid_size) % 2) ? hi - 1 - (k - lo) : k;
+		if (!tg_done(ctx, i, kk % tg_grid_size))
+			todo[n++] = kk;
+	}
 
-		do_task_group(ctx, i, j);
+	/* double-buffering: the data of task group u+1 is loaded during u */
+	struct tg_data_t data[2];
+	if (n > 0)
+		tg_load_start(ctx, todo[0] / tg_grid_size, todo[0] % tg_grid_size, &data[0]);
+	for (int u = 0; u < n; u++) {
+		struct tg_data_t *next = (u + 1 < n) ? &data[(u + 1) % 2] : NULL;
+		int next_k = (u + 1 < n) ? todo[u + 1] : 0;
+		do_task_group(ctx, &data[u % 2], next, next_k / tg_grid_size, next_k % tg_grid_size);
 	}
+	free(todo);
+	if (ctx->rank == 0)
+		printf("Files loaded: %d, reused: %d\n", ctx->files_loaded, ctx->files_reused);
 }
 
 
 int main(int argc, char **argv)
 {
-	MPI_Init(&argc, &argv);
+	/* only the main thread calls MPI (file readers don't) */
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	if (provided < MPI_THREAD_FUNNELED)
+		errx(1, "MPI does not support threads");
 	int i, j, job;
 	struct tg_context_t * ctx = setup(argc, argv, &i, &j, &job);
 	
 	if (job < 0) {
 		/* do single task group */
-		do_task_group(ctx, i, j);
+		if (!tg_done(ctx, i, j)) {
+			struct tg_data_t data;
+			tg_load_start(ctx, i, j, &data);
+			do_task_group(ctx, &data, NULL, 0, 0);
+		}
 	} else {
 		do_job(ctx, job);
 	}
 	
+	MPI_Win_unlock_all(ctx->counters);
+	MPI_Win_free(&ctx->counters);
 	MPI_Finalize();
 }
\ No newline at end of file
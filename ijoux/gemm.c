@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <err.h>
+#include <strings.h>
+
+#include <omp.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "gemm.h"
+
+/* Computing x * M for a 64x64 boolean matrix M (given by rows) is the
+   first phase of every slice. Several engines are available; unless one is
+   named, the fastest one on this CPU is selected by a short calibration. The scalar engine, which
+   works everywhere (including the BG/Q), is always available. */
+
+u64 naive_gemv(u64 x, const u64 * M)
+{
+	u64 y = 0;
+	for (u32 i = 0; i < 64; i++) {
+		u64 bit = (x >> i) & 1;
+		u64 mask = (u64) (-((i64) bit));
+		y ^= M[i] & mask;
+	}
+	return y;
+}
+
+void matmul_init(const u64 * M, struct matmul_table_t *T)
+{
+	/* 8-bit tables, in gray code order */
+	for (u32 i = 0; i < 8; i++) {
+		u32 lo = i * 8;
+		T->tables[i][0] = 0;
+		u64 tmp = 0;
+		for (u32 j = 1; j < 256; j++) {
+			u32 k = ffs(j) - 1;
+			tmp ^= M[lo + k];
+			T->tables[i][j ^ (j >> 1)] = tmp;
+		}
+	}
+
+	/* affine[i][b] is the 8x8 block mapping input byte i to output byte b.
+	   Following the GF2P8AFFINEQB convention, byte (7 - j) of the block is
+	   the mask of input bits that contribute to output bit j. */
+	for (u32 i = 0; i < 8; i++)
+		for (u32 b = 0; b < 8; b++) {
+			u64 A = 0;
+			for (u32 j = 0; j < 8; j++)
+				for (u32 t = 0; t < 8; t++) {
+					u64 bit = (M[8 * i + t] >> (8 * b + j)) & 1;
+					A |= bit << (8 * (7 - j) + t);
+				}
+			T->affine[i][b] = A;
+		}
+}
+
+static inline u64 gemv(u64 x, const struct matmul_table_t *M)
+{
+	u64 r = 0;
+	r ^= M->tables[0][x & 0x00ff];
+	r ^= M->tables[1][(x >> 8) & 0x00ff];
+	r ^= M->tables[2][(x >> 16) & 0x00ff];
+	r ^= M->tables[3][(x >> 24) & 0x00ff];
+	r ^= M->tables[4][(x >> 32) & 0x00ff];
+	r ^= M->tables[5][(x >> 40) & 0x00ff];
+	r ^= M->tables[6][(x >> 48) & 0x00ff];
+	r ^= M->tables[7][(x >> 56) & 0x00ff];
+	return r;
+}
+
+static bool scalar_supported()
+{
+	return true;
+}
+
+static void scalar_gemm(const u64 * IN, u64 * OUT, u32 n, const struct matmul_table_t *M)
+{
+	for (u32 i = 0; i < n; i++)
+		OUT[i] = gemv(IN[i], M);
+}
+
+
+#ifdef __x86_64__
+static bool avx2_supported()
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* 4 items at a time, with gathers in the 8-bit tables */
+__attribute__ ((target("avx2")))
+static void avx2_gemm(const u64 * IN, u64 * OUT, u32 n, const struct matmul_table_t *M)
+{
+	const __m256i mask = _mm256_set1_epi64x(0x00ff);
+	u32 i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((__m256i *) (IN + i));
+		__m256i r = _mm256_setzero_si256();
+		for (u32 j = 0; j < 8; j++) {
+			__m256i idx = _mm256_and_si256(_mm256_srli_epi64(x, 8 * j), mask);
+			__m256i y = _mm256_i64gather_epi64((const long long *) M->tables[j], idx, 8);
+			r = _mm256_xor_si256(r, y);
+		}
+		_mm256_storeu_si256((__m256i *) (OUT + i), r);
+	}
+	for (; i < n; i++)
+		OUT[i] = gemv(IN[i], M);
+}
+
+static bool avx512_supported()
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+/* 8 items at a time, with gathers in the 8-bit tables */
+__attribute__ ((target("avx512f")))
+static void avx512_gemm(const u64 * IN, u64 * OUT, u32 n, const struct matmul_table_t *M)
+{
+	const __m512i mask = _mm512_set1_epi64(0x00ff);
+	for (u32 i = 0; i < n; i += 8) {
+		__mmask8 k = (n - i >= 8) ? 0xff : (1 << (n - i)) - 1;
+		__m512i x = _mm512_maskz_loadu_epi64(k, IN + i);
+		__m512i r = _mm512_setzero_si512();
+		for (u32 j = 0; j < 8; j++) {
+			__m512i idx = _mm512_and_si512(_mm512_srli_epi64(x, 8 * j), mask);
+			__m512i y = _mm512_i64gather_epi64(idx, M->tables[j], 8);
+			r = _mm512_xor_si512(r, y);
+		}
+		_mm512_mask_storeu_epi64(OUT + i, k, r);
+	}
+}
+
+static bool gfni_supported()
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+		&& __builtin_cpu_supports("avx512vbmi")
+		&& __builtin_cpu_supports("gfni");
+}
+
+/* 8 items at a time, without memory lookups. Byte k of qword b of S_i is
+   byte i of item k; GF2P8AFFINEQB multiplies it by the 8x8 block (i, b).
+   Summing over i yields the transpose of the output (byte b of item k in
+   qword b), which a last byte permutation puts back in place. */
+__attribute__ ((target("avx512f,avx512bw,avx512vbmi,gfni")))
+static void gfni_gemm(const u64 * IN, u64 * OUT, u32 n, const struct matmul_table_t *M)
+{
+	u8 spread[8][64] __attribute__ ((aligned(64)));
+	u8 transpose[64] __attribute__ ((aligned(64)));
+	for (u32 b = 0; b < 8; b++)
+		for (u32 k = 0; k < 8; k++) {
+			for (u32 i = 0; i < 8; i++)
+				spread[i][8 * b + k] = 8 * k + i;
+			transpose[8 * k + b] = 8 * b + k;
+		}
+	__m512i S[8], A[8];
+	for (u32 i = 0; i < 8; i++) {
+		S[i] = _mm512_load_si512(spread[i]);
+		A[i] = _mm512_load_si512(M->affine[i]);
+	}
+	const __m512i T = _mm512_load_si512(transpose);
+
+	for (u32 i = 0; i < n; i += 8) {
+		__mmask8 k = (n - i >= 8) ? 0xff : (1 << (n - i)) - 1;
+		__m512i x = _mm512_maskz_loadu_epi64(k, IN + i);
+		__m512i r = _mm512_setzero_si512();
+		for (u32 j = 0; j < 8; j++) {
+			__m512i s = _mm512_permutexvar_epi8(S[j], x);
+			r = _mm512_xor_si512(r, _mm512_gf2p8affine_epi64_epi8(s, A[j], 0));
+		}
+		r = _mm512_permutexvar_epi8(T, r);
+		_mm512_mask_storeu_epi64(OUT + i, k, r);
+	}
+}
+#endif
+
+/* by decreasing order of capability */
+const struct gemm_engine_t gemm_engines[] = {
+#ifdef __x86_64__
+	{"gfni", gfni_supported, gfni_gemm},
+	{"avx512", avx512_supported, avx512_gemm},
+	{"avx2", avx2_supported, avx2_gemm},
+#endif
+	{"scalar", scalar_supported, scalar_gemm},
+	{NULL, NULL, NULL}
+};
+
+/* the gathers are not always faster than the scalar 8-bit tables: time
+   every supported engine on a few thousand random items (best of several
+   rounds) and keep the fastest */
+static const struct gemm_engine_t *calibrate()
+{
+	static const u32 N = 4096;
+	static const u32 ROUNDS = 16;
+	struct matmul_table_t *T = aligned_alloc(64, sizeof(*T));
+	u64 *IN = aligned_alloc(64, 2 * N * sizeof(*IN));
+	if (T == NULL || IN == NULL)
+		err(1, "cannot allocate GEMM calibration data");
+	u64 *OUT = IN + N;
+	u64 x = 0x9e3779b97f4a7c15ull;
+	for (u32 i = 0; i < N; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		IN[i] = x;
+	}
+	matmul_init(IN + N - 64, T);
+
+	const struct gemm_engine_t *best = NULL;
+	double best_time = 0;
+	for (const struct gemm_engine_t *e = gemm_engines; e->name != NULL; e++) {
+		if (!e->supported())
+			continue;
+		e->gemm(IN, OUT, N, T);		/* warm-up */
+		double time = INFINITY;
+		for (u32 r = 0; r < ROUNDS; r++) {
+			double start = omp_get_wtime();
+			e->gemm(IN, OUT, N, T);
+			time = fmin(time, omp_get_wtime() - start);
+		}
+		if (best == NULL || time < best_time) {
+			best = e;
+			best_time = time;
+		}
+	}
+	free(T);
+	free(IN);
+	return best;
+}
+
+/* returns the named engine, or the fastest supported one if name is NULL */
+const struct gemm_engine_t *gemm_engine_select(const char *name)
+{
+	if (name == NULL) {
+		static const struct gemm_engine_t *fastest = NULL;
+		#pragma omp critical(gemm_calibration)
+		if (fastest == NULL)
+			fastest = calibrate();
+		if (fastest == NULL)
+			errx(1, "no GEMM engine available");
+		return fastest;
+	}
+	for (const struct gemm_engine_t *e = gemm_engines; e->name != NULL; e++) {
+		if (strcmp(name, e->name) != 0)
+			continue;
+		if (!e->supported())
+			errx(1, "GEMM engine %s not supported on this CPU", name);
+		return e;
+	}
+	errx(1, "unknown GEMM engine %s", name);
+}
@@ -0,0 +1,21 @@
+#include "../types.h"
+
+/* precomputed representations of a 64x64 boolean matrix, used to compute
+   x * M for many x. Each engine uses the part it needs. */
+struct matmul_table_t {
+	u64 tables[8][256] __attribute__ ((aligned(64)));   /* 8-bit lookup tables */
+	u64 affine[8][8] __attribute__ ((aligned(64)));     /* 8x8 blocks for GF2P8AFFINEQB */
+};
+
+/* an engine computes OUT[i] = IN[i] * M for 0 <= i < n, single-threaded */
+struct gemm_engine_t {
+	const char *name;
+	bool (*supported)();
+	void (*gemm)(const u64 *IN, u64 *OUT, u32 n, const struct matmul_table_t *M);
+};
+
+extern const struct gemm_engine_t gemm_engines[];
+
+u64 naive_gemv(u64 x, const u64 *M);
+void matmul_init(const u64 *M, struct matmul_table_t *T);
+const struct gemm_engine_t *gemm_engine_select(const char *name);
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <inttypes.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "common.h"
+#include "join.h"
+
+/* Joining two partitions (phase 3) is done with a small hash table on A,
+   probed with the elements of B, or by sorting both of them when they do
+   not fit in the hash table. Several engines are available; the best one
+   supported by the CPU for the expected size of the partitions is
+   selected at runtime. The linear-probing engine works everywhere
+   (including the BG/Q). */
+
+static const u32 HASH_SIZE = 16384 / 4 / sizeof(u64);
+static const u64 HASH_MASK = 16384 / 4 / sizeof(u64) - 1;
+
+static bool linear_supported()
+{
+	return true;
+}
+
+/* linear probing, one item of B at a time */
+static void linear_join(u32 l, u32 T, const struct scattered_t *A, const struct scattered_t *B,
+		         struct candidates_t *out)
+{
+	u8 shift = 64 - l;
+	u64 H[HASH_SIZE];
+
+	/* build phase */
+	for (u32 i = 0; i < HASH_SIZE; i++)
+		H[i] = 0;
+	for (u32 t = 0; t < T; t++) {
+		const u64 *L = A->L[t];
+		u32 n = A->n[t];
+		for (u32 i = 0; i < n; i++) {
+			u32 h = (L[i] >> shift) & HASH_MASK;
+			while (H[h] != 0)
+				h = (h + 1) & HASH_MASK;
+			H[h] = L[i];
+		}
+	}
+
+	/* probe phase */
+	for (u32 t = 0; t < T; t++) {
+		const u64 *L = B->L[t];
+		u32 n = B->n[t];
+		for (u32 i = 0; i < n; i++) {
+			u64 y = L[i];
+			u32 h = (y >> shift) & HASH_MASK;
+			u64 x = H[h];
+			while (x != 0) {
+				u64 z = x ^ y;
+				if ((z >> shift) == 0) {
+					emit(out, x, y);
+				}
+				h = (h + 1) & HASH_MASK;
+				x = H[h];
+			}
+		}
+	}
+}
+
+
+static bool sort_supported()
+{
+	return true;
+}
+
+/* LSD radix sort of L[0:n] on bits [shift:shift + bits], 8 bits at a time.
+   tmp must have room for n items. */
+static void radix_sort(u64 *L, u64 *tmp, u32 n, u32 shift, u32 bits)
+{
+	u64 *src = L;
+	u64 *dst = tmp;
+	for (u32 lo = 0; lo < bits; lo += 8) {
+		u32 s = shift + lo;
+		u32 count[256];
+		for (u32 d = 0; d < 256; d++)
+			count[d] = 0;
+		for (u32 i = 0; i < n; i++)
+			count[(src[i] >> s) & 0xff]++;
+		u32 acc = 0;
+		for (u32 d = 0; d < 256; d++) {
+			u32 c = count[d];
+			count[d] = acc;
+			acc += c;
+		}
+		for (u32 i = 0; i < n; i++)
+			dst[count[(src[i] >> s) & 0xff]++] = src[i];
+		u64 *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != L)
+		memcpy(L, src, n * sizeof(*L));
+}
+
+/* copy the non-zero items of a scattered partition to L, and sort them on
+   their l-bit key. Only the bits that actually differ are sorted (the
+   first p are common to the whole partition). Returns the number of items. */
+static u32 gather_and_sort(u8 shift, u32 T, const struct scattered_t *S, u64 *L, u64 *tmp)
+{
+	u32 n = 0;
+	for (u32 t = 0; t < T; t++)
+		for (u32 i = 0; i < S->n[t]; i++)
+			if (S->L[t][i] != 0)
+				L[n++] = S->L[t][i];
+	if (n == 0)
+		return 0;
+	u64 diff = 0;
+	for (u32 i = 1; i < n; i++)
+		diff |= (L[i] ^ L[0]) >> shift;
+	u32 bits = (diff == 0) ? 0 : 64 - __builtin_clzll(diff);
+	radix_sort(L, tmp, n, shift, bits);
+	return n;
+}
+
+/* Radix-sort both partitions on their key, then merge them. Works for
+   partitions of any size, as long as out->scratch is large enough. */
+static void sort_join(u32 l, u32 T, const struct scattered_t *A, const struct scattered_t *B,
+		       struct candidates_t *out)
+{
+	u8 shift = 64 - l;
+	u64 nA = 0, nB = 0;
+	for (u32 t = 0; t < T; t++) {
+		nA += A->n[t];
+		nB += B->n[t];
+	}
+	if (nA + nB + MAX(nA, nB) > out->scratch_size)
+		errx(1, "sort-merge scratch space too small (|A|=%" PRIu64 ", |B|=%" PRIu64 ")", nA, nB);
+	u64 *scratch = out->scratch;
+	u64 *LA = scratch;
+	u64 *LB = scratch + nA;
+	u64 *tmp = scratch + nA + nB;
+	nA = gather_and_sort(shift, T, A, LA, tmp);
+	nB = gather_and_sort(shift, T, B, LB, tmp);
+
+	/* merge phase */
+	u32 i = 0, j = 0;
+	while (i < nA && j < nB) {
+		u64 a = LA[i] >> shift;
+		u64 b = LB[j] >> shift;
+		if (a < b) {
+			i++;
+		} else if (a > b) {
+			j++;
+		} else {
+			u32 j_end = j;
+			while (j_end < nB && (LB[j_end] >> shift) == a)
+				j_end++;
+			for (; i < nA && (LA[i] >> shift) == a; i++)
+				for (u32 k = j; k < j_end; k++)
+					emit(out, LA[i], LB[k]);
+			j = j_end;
+		}
+	}
+}
+
+
+#ifdef __x86_64__
+static bool avx2_supported()
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* Buckets of 4 slots (one 256-bit register), with linear probing on the
+   buckets. Next to the items, the table holds their l-bit keys with the
+   sign bit set, so that a whole bucket is compared with the key of y in
+   one instruction, and the sign bits tell which slots are occupied. The
+   probe stops at the first bucket that has an empty slot. */
+__attribute__ ((target("avx2")))
+static void avx2_join(u32 l, u32 T, const struct scattered_t *A, const struct scattered_t *B,
+		       struct candidates_t *out)
+{
+	static const u32 N_BUCKETS = HASH_SIZE / 4;
+	static const u32 BUCKET_MASK = HASH_SIZE / 4 - 1;
+	static const u64 OCCUPIED = 0x8000000000000000ull;
+	u8 shift = 64 - l;
+	u64 H[HASH_SIZE] __attribute__ ((aligned(32)));
+	u64 K[HASH_SIZE] __attribute__ ((aligned(32)));
+
+	/* build phase */
+	for (u32 i = 0; i < HASH_SIZE; i++)
+		K[i] = 0;
+	for (u32 t = 0; t < T; t++) {
+		const u64 *L = A->L[t];
+		u32 n = A->n[t];
+		for (u32 i = 0; i < n; i++) {
+			u64 x = L[i];
+			if (x == 0)
+				continue;
+			u64 key = x >> shift;
+			u32 h = 4 * (key & BUCKET_MASK);
+			while (K[h] != 0)
+				h = (h + 1) & HASH_MASK;
+			H[h] = x;
+			K[h] = key | OCCUPIED;
+		}
+	}
+
+	/* probe phase */
+	for (u32 t = 0; t < T; t++) {
+		const u64 *L = B->L[t];
+		u32 n = B->n[t];
+		for (u32 i = 0; i < n; i++) {
+			u64 y = L[i];
+			u64 key = y >> shift;
+			__m256i Y = _mm256_set1_epi64x(key | OCCUPIED);
+			u32 b = key & BUCKET_MASK;
+			for (u32 probe = 0; probe < N_BUCKETS; probe++) {
+				__m256i S = _mm256_load_si256((__m256i *) (K + 4 * b));
+				__m256i hit = _mm256_cmpeq_epi64(S, Y);
+				u32 m_hit = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+				u32 m_occupied = _mm256_movemask_pd(_mm256_castsi256_pd(S));
+				while (m_hit) {
+					u32 j = __builtin_ctz(m_hit);
+					u64 x = H[4 * b + j];
+					emit(out, x, y);
+					m_hit &= m_hit - 1;
+				}
+				if (m_occupied != 0xf)
+					break;
+				b = (b + 1) & BUCKET_MASK;
+			}
+		}
+	}
+}
+#endif
+
+/* by decreasing order of preference. Linear probing rarely goes past the
+   first slot when the table is less than ~30% full, and then beats the
+   overhead of the SIMD compares. Sorting takes over when the hash tables
+   would be more than half full. */
+const struct join_engine_t join_engines[] = {
+	{"sort", sort_supported, HASH_SIZE / 2, 0xffffffff, sort_join},
+#ifdef __x86_64__
+	{"avx2", avx2_supported, HASH_SIZE * 3 / 10, HASH_SIZE - 1, avx2_join},
+#endif
+	{"linear", linear_supported, 0, HASH_SIZE - 1, linear_join},
+	{NULL, NULL, 0, 0, NULL}
+};
+
+/* returns the named engine, or else the best supported one for partitions
+   of expected_size items on average and at most max_size items */
+const struct join_engine_t *join_engine_select(const char *name, u32 expected_size, u32 max_size)
+{
+	if (name == NULL) {
+		for (const struct join_engine_t *e = join_engines; e->name != NULL; e++)
+			if (e->supported() && expected_size >= e->min_size && max_size <= e->capacity)
+				return e;
+		for (const struct join_engine_t *e = join_engines; e->name != NULL; e++)
+			if (e->supported() && max_size <= e->capacity)
+				return e;
+		errx(1, "no join engine available");
+	}
+	for (const struct join_engine_t *e = join_engines; e->name != NULL; e++) {
+		if (strcmp(name, e->name) != 0)
+			continue;
+		if (!e->supported())
+			errx(1, "join engine %s not supported on this CPU", name);
+		return e;
+	}
+	errx(1, "unknown join engine %s", name);
+}
@@ -0,0 +1,62 @@
+#include "../types.h"
+#include "datastructures.h"
+
+/* a partition of L, scattered in the private buckets of the T threads
+   that dispatched it: L[t][0:n[t]] for 0 <= t < T */
+struct scattered_t {
+	u64 **L;
+	u32 *n;
+};
+
+/* Candidate triplets (x, y, x ^ y) produced by a join, in a small buffer.
+   When the buffer is full, flush() consumes its content and empties it,
+   so that candidates are handled while they are still in cache.
+
+   If H is set, candidates are not buffered: x ^ y is looked up in the
+   cuckoo table H right away, and found() is called on the hits. */
+struct candidates_t {
+	u64 (*buf)[3];
+	u32 size;
+	u32 capacity;
+	u64 total;		/* number of triplets emitted so far */
+	u64 flush_usec;		/* time spent in flush() (maintained by flush) */
+	void (*flush)(struct candidates_t *c);
+	const u64 *H;
+	void (*found)(struct candidates_t *c, u64 x, u64 y);
+	void *ctx;		/* for flush() and found() */
+	u64 *scratch;		/* for the sort engine: |A| + |B| + max(|A|, |B|) items */
+	u64 scratch_size;
+};
+
+static inline void emit(struct candidates_t *c, u64 x, u64 y)
+{
+	if (c->H != NULL) {
+		c->total++;
+		if (cuckoo_lookup(c->H, x ^ y))
+			c->found(c, x, y);
+		return;
+	}
+	if (c->size == c->capacity)
+		c->flush(c);
+	c->buf[c->size][0] = x;
+	c->buf[c->size][1] = y;
+	c->buf[c->size][2] = x ^ y;
+	c->size++;
+	c->total++;
+}
+
+/* an engine finds all the pairs (x, y) in A x B whose l most significant
+   bits agree and emits (x, y, x ^ y) to out. Items equal to zero are
+   ignored. */
+struct join_engine_t {
+	const char *name;
+	bool (*supported)();
+	u32 min_size;		/* preferred for partitions of this average size or more */
+	u32 capacity;		/* max number of items in A */
+	void (*join)(u32 l, u32 T, const struct scattered_t *A, const struct scattered_t *B,
+		     struct candidates_t *out);
+};
+
+extern const struct join_engine_t join_engines[];
+
+const struct join_engine_t *join_engine_select(const char *name, u32 expected_size, u32 max_size);
@@ -9,45 +9,63 @@
 #include <strings.h>
 
 #include <omp.h>
-// #include <papi.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "common.h"
-#include "datastructures.h"
+#include "gemm.h"
+#include "join.h"
+#include "perf.h"
 
 
 struct side_t {
-	u64 *L;			/* input list */
+	const u64 *L;		/* input list */
 	u32 n;			/* size of L */
 
 	/**** multi-threaded partitioning ****/
 	u32 psize;		/* capacity of partitions */
 	u32 tsize;		/* capacity of thread-private buckets */
-	u64 *LM;		/* scratch space for the matrix product */
-	u64 *scratch;		/* scratch space for partitioning */
-	u32 *count;		/* counters for dispatching */
+	u64 *scratch;		/* scratch space for partitioning (K slots) */
+	u32 *count;		/* counters for dispatching (K slots) */
+	u32 scratch_size;	/* size of a slot in scratch */
+	u32 count_size;		/* size of a slot in count */
 	u32 partition_size;	/* upper-bound on the actual number of items in
 				   a partition */
 };
 
 struct context_t {
 	/**** input ****/
-	u64 *L[2];
+	const u64 *L[2];
 	u32 n[2];
 
 	/**** nicely presented input ****/
 	struct side_t side[2];
 
 	/**** tuning parameters ****/
-	u32 T_gemm, T_part, T_subj;	/* number of threads */
+	u32 T_part, T_subj;	/* number of threads */
 	u32 p;			/* bits used in partitioning */
+	u32 K;			/* slices processed per pass over L */
+	bool two_phase;		/* buffer candidates instead of checking them inline */
+	const struct gemm_engine_t *gemm_engine;
+	const struct join_engine_t *join_engine;
+	const struct join_engine_t *overflow_engine;	/* for partitions too large for join_engine */
+	cuckoo_lookup_many_t lookup_many;	/* phase 4, on buffered candidates */
 
 	/**** performance measurement ****/
 	u64 volume, probes;
-	u64 gemm_usec, part_usec, subj_usec, chck_usec;
-	u32 bad_slice;
+	u64 read_volume;	/* items of L actually read by phases 1+2 */
+	u64 part_usec, subj_usec, chck_usec;
+	u32 rehashed;		/* slices whose CM table needed other hash functions */
+	u32 overflows;		/* partitions handed to overflow_engine */
+	struct perf_t *perf;	/* per-thread hardware counters (NULL = off) */
 
 	/**** scratch space ****/
-	u64 (*preselected[4])[3];
+	u64 (*wc)[8];		/* write-combining buffers (one line per bucket) */
+	struct candidates_t *candidates;	/* one buffer per subjoin thread */
+	struct slice_ctx_t *batch;	/* the slices of the current pass */
+	u32 batch_size;
+	long long mark;		/* start of the current phase */
 
 	/**** output ****/
 	struct task_result_t *result;
@@ -56,18 +74,16 @@ struct context_t {
 struct slice_ctx_t {
 	const struct slice_t *slice;
 	u64 *H;
+	struct matmul_table_t *M;
+	u32 next_partition;	/* dispatching of the subjoins */
+	u64 chck_usec;		/* time spent in phase 4, over all threads */
 	struct task_result_t *result;
-};
-struct matmul_table_t {
-	u64 tables[8][256] __attribute__ ((aligned(64)));
-};
-
-struct scattered_t {
-	u64 **L;
-	u32 *n;
+	struct perf_t *perf;	/* per-thread hardware counters (NULL = off) */
+	cuckoo_lookup_many_t lookup_many;
 };
 
 static const u32 CACHE_LINE_SIZE = 64;
+static const u32 CANDIDATES_SIZE = 1024;	/* 24 Kbyte per subjoin thread */
 
 static u64 ROUND(u64 s)
 {
@@ -91,15 +107,12 @@ static void prepare_side(struct context_t *self, u32 k, bool verbose)
 	u32 psize = tsize * T;
 	u32 scratch_size = psize * fan_out;
 	u32 partition_size = chernoff_bound(n, fan_out);
+	u32 count_size = ROUND(T * fan_out);
 
-	u64 *scratch = aligned_alloc(CACHE_LINE_SIZE, sizeof(u64) * scratch_size);
+	u64 *scratch = aligned_alloc(CACHE_LINE_SIZE, sizeof(u64) * scratch_size * self->K);
 	if (scratch == NULL)
 		err(1, "failed to allocate scratch space");
-	u64 *LM = aligned_alloc(CACHE_LINE_SIZE, sizeof(u64) * n);
-	if (LM == NULL)
-		err(1, "failed to allocate LM");
-	u32 count_size = ROUND(sizeof(u32) * T * fan_out);
-	u32 *count = aligned_alloc(CACHE_LINE_SIZE, count_size);
+	u32 *count = aligned_alloc(CACHE_LINE_SIZE, sizeof(u32) * count_size * self->K);
 	if (count == NULL)
 		err(1, "failed to allocate count");
 
@@ -109,12 +122,13 @@ static void prepare_side(struct context_t *self, u32 k, bool verbose)
 	side->tsize = tsize;
 	side->psize = psize;
 	side->scratch = scratch;
-	side->LM = LM;
 	side->count = count;
+	side->scratch_size = scratch_size;
+	side->count_size = count_size;
 	side->partition_size = partition_size;
 
 	if (verbose) {
-		printf("side %d, n=%d, T=%d\n", k, n, T);
+		printf("side %d, n=%d, T=%d, K=%d\n", k, n, T, self->K);
 		printf("========================\n");
 		double expansion = (100.0 * (scratch_size - n)) / n;
 		printf
@@ -126,279 +140,580 @@ static void prepare_side(struct context_t *self, u32 k, bool verbose)
 }
 
 
-static u64 naive_gemv(u64 x, const u64 * M)
+/* software write-combining: copy a full cache line to the scratch space,
+   bypassing the cache (the partitions are only read back in phase 3). */
+static inline void wc_flush(u64 *dst, const u64 *src)
 {
-	u64 y = 0;
-	for (u32 i = 0; i < 64; i++) {
-		u64 bit = (x >> i) & 1;
-		u64 mask = (u64) (-((i64) bit));
-		y ^= M[i] & mask;
+#ifdef __x86_64__
+	for (u32 i = 0; i < 8; i += 2)
+		_mm_stream_si128((__m128i *) (dst + i), _mm_load_si128((__m128i *) (src + i)));
+#else
+	for (u32 i = 0; i < 8; i++)
+		dst[i] = src[i];
+#endif
+}
+
+/* dispatch a block of items into the partitions of one slot */
+static inline void scatter(const u64 *LM, u32 size, u8 shift, u32 *count,
+			   u64 (*wc)[8], u64 *scratch)
+{
+	for (u32 i = 0; i < size; i++) {
+		u64 x = LM[i];
+		u64 h = x >> shift;
+		u32 idx = count[h]++;
+		wc[h][idx & 7] = x;
+		if ((idx & 7) == 7)
+			wc_flush(scratch + idx - 7, wc[h]);
 	}
-	return y;
 }
 
-static inline u64 gemv(u64 x, const struct matmul_table_t *M)
+/* multiply L by the matrices of the K slices of the batch and dispatch the
+   results in the partitions, in a single pass. Each block of L is read
+   once from memory for all the slices. Buckets start on cache line
+   boundaries, so each line of wc is written out as soon as it is full.
+   Called by each of the first T_part threads of the team. */
+static void gemm_partition(struct context_t *self, struct side_t *side, u32 K)
 {
-	u64 r = 0;
-	r ^= M->tables[0][x & 0x00ff];
-	r ^= M->tables[1][(x >> 8) & 0x00ff];
-	r ^= M->tables[2][(x >> 16) & 0x00ff];
-	r ^= M->tables[3][(x >> 24) & 0x00ff];
-	r ^= M->tables[4][(x >> 32) & 0x00ff];
-	r ^= M->tables[5][(x >> 40) & 0x00ff];
-	r ^= M->tables[6][(x >> 48) & 0x00ff];
-	r ^= M->tables[7][(x >> 56) & 0x00ff];
-	return r;
+	static const u32 GEMM_BLOCK = 256;
+	u32 tid = omp_get_thread_num();
+	u32 fan_out = 1 << self->p;
+	u32 *count[K];
+	u64 (*wc[K])[8];
+	u64 *scratch[K];
+	for (u32 b = 0; b < K; b++) {
+		count[b] = side->count + b * side->count_size + tid * fan_out;
+		wc[b] = self->wc + (b * self->T_part + tid) * fan_out;
+		scratch[b] = side->scratch + ((u64) b) * side->scratch_size;
+		for (u32 i = 0; i < fan_out; i++)
+			count[b][i] = side->psize * i + side->tsize * tid;
+	}
+	const u64 *L = side->L;
+	const u32 n = side->n;
+	u8 shift = 64 - self->p;
+	u64 LM[GEMM_BLOCK];
+
+	/* static schedule over the first T_part threads */
+	u32 n_blocks = (n + GEMM_BLOCK - 1) / GEMM_BLOCK;
+	u32 from = ((u64) n_blocks) * tid / self->T_part;
+	u32 to = ((u64) n_blocks) * (tid + 1) / self->T_part;
+	for (u32 lo = from * GEMM_BLOCK; lo < MIN(n, to * GEMM_BLOCK); lo += GEMM_BLOCK) {
+		u32 size = MIN(n - lo, GEMM_BLOCK);
+		for (u32 b = 0; b < K; b++) {
+			self->gemm_engine->gemm(L + lo, LM, size, self->batch[b].M);
+			scatter(LM, size, shift, count[b], wc[b], scratch[b]);
+		}
+	}
+
+	/* flush incomplete lines */
+	for (u32 b = 0; b < K; b++)
+		for (u32 h = 0; h < fan_out; h++) {
+			u32 idx = count[b][h];
+			for (u32 j = 0; j < (idx & 7); j++)
+				scratch[b][(idx & ~7) + j] = wc[b][h][j];
+		}
+#ifdef __x86_64__
+	_mm_sfence();
+#endif
 }
 
-static void matmul_init(const u64 * M, struct matmul_table_t *T)
+static void checkup(struct slice_ctx_t *ctx, u32 size, u64 (*preselected)[3], u64 *H)
 {
-	#pragma omp parallel for schedule(static)
-	for (u32 i = 0; i < 8; i++) {
-		u32 lo = i * 8;
-		T->tables[i][0] = 0;
-		u64 tmp = 0;
-		for (u32 j = 1; j < 256; j++) {
-			u32 k = ffs(j) - 1;
-			tmp ^= M[lo + k];
-			T->tables[i][j ^ (j >> 1)] = tmp;
+	for (u32 i = 0; i < size; i += 8) {
+		u32 n = MIN(8, size - i);
+		u64 z[8];
+		for (u32 j = 0; j < n; j++)
+			z[j] = preselected[i + j][2];
+		u32 hits = ctx->lookup_many(H, z, n);
+		while (hits) {
+			u32 j = __builtin_ctz(hits);
+			struct solution_t solution;
+			solution.val[0] = preselected[i + j][0];
+			solution.val[1] = preselected[i + j][1];
+			solution.val[2] = preselected[i + j][2];
+			#pragma omp critical(slice_result)
+			report_solution(ctx->result, &solution);
+			hits &= hits - 1;
 		}
 	}
 }
 
-static void gemm(const u64 * IN, u64 * OUT, u32 n, const struct matmul_table_t *M)
+/* phase 4, on a single candidate that is in CM (inline mode) */
+static void report_candidate(struct candidates_t *c, u64 x, u64 y)
 {
-	#pragma omp for schedule(static)
-	for (u32 i = 0; i < n; i++)
-		OUT[i] = gemv(IN[i], M);
+	struct slice_ctx_t *ctx = c->ctx;
+	struct solution_t solution;
+	solution.val[0] = x;
+	solution.val[1] = y;
+	solution.val[2] = x ^ y;
+	#pragma omp critical(slice_result)
+	report_solution(ctx->result, &solution);
 }
 
-static void partition(u32 p, struct side_t *side)
+/* phase 4, on a full buffer of candidates produced by phase 3 */
+static void check_candidates(struct candidates_t *c)
 {
-	u32 tid = omp_get_thread_num();
-	u32 fan_out = 1 << p;
-	u32 *count = side->count + tid * fan_out;
-	for (u32 i = 0; i < fan_out; i++)
-		count[i] = side->psize * i + side->tsize * tid;
-	const u64 *L = side->LM;
-	const u32 n = side->n;
-	u64 *scratch = side->scratch;
-	u8 shift = 64 - p;
+	if (c->size == 0)
+		return;
+	struct slice_ctx_t *ctx = c->ctx;
+	struct perf_t *perf = (ctx->perf != NULL) ? &ctx->perf[omp_get_thread_num()] : NULL;
+	u64 since[PERF_EVENTS];
+	perf_read(perf, since);
+	long long start = usec();
+	checkup(ctx, c->size, c->buf, ctx->H);
+	c->size = 0;
+	c->flush_usec += usec() - start;
+	perf_add(perf, PERF_CHECK, since);
+}
 
-	#pragma omp for schedule(static)
-	for (u32 i = 0; i < n; i++) {
-		u64 x = L[i];
-		u64 h = x >> shift;
-		u32 idx = count[h]++;
-		scratch[idx] = x;
-	}
+
+static void slice_init(struct context_t *self, struct slice_ctx_t *ctx, const struct slice_t *slice)
+{
+	ctx->slice = slice;
+	ctx->perf = self->perf;
+	ctx->lookup_many = self->lookup_many;
+	result_clear(ctx->result);
+	if (cuckoo_build(slice->CM, 0, slice->n, 64 - slice->l, ctx->H) > 0)
+		self->rehashed++;
+	u64 volume = self->n[0] + self->n[1];
+	self->volume += volume;
+	if (slice->l - self->p < 9)
+		printf("WARNING : l and p are too close (increase l)\n");
+	matmul_init(slice->M, ctx->M);
 }
 
-static u64 subjoin(struct slice_ctx_t *ctx, u32 T, struct scattered_t *partitions, u64 (*preselected)[3])
+/* phases 3 and 4 for the b-th slice of the batch. Called by all the
+   threads of the team; the first T_subj ones do the work. */
+static void slice_join(struct context_t *self, u32 b, const u32 *task_index)
 {
-	static const u32 HASH_SIZE = 16384 / 4 / sizeof(u64);
-	static const u64 HASH_MASK = 16384 / 4 / sizeof(u64) - 1;
-	u8 l = ctx->slice->l;
-	u8 shift = 64 - l;
-	u64 H[HASH_SIZE];
-
-	/* build phase */
-	for (u32 i = 0; i < HASH_SIZE; i++)
-		H[i] = 0;
-	for (u32 t = 0; t < T; t++) {
-		u64 *A = partitions[0].L[t];
-		u32 nA = partitions[0].n[t];
-		for (u32 i = 0; i < nA; i++) {
-			u32 h = (A[i] >> shift) & HASH_MASK;
-			while (H[h] != 0)
-				h = (h + 1) & HASH_MASK;
-			H[h] = A[i];
+	struct slice_ctx_t *ctx = &self->batch[b];
+	u32 fan_out = 1 << self->p;
+	u32 tid = omp_get_thread_num();
+
+	/************* phases 3+4: subjoins, and intersection with CM */
+
+	/* candidates are checked as soon as they are found. In two-phase mode,
+	   those of each thread are checked each time its buffer is full, and
+	   once more at the end */
+	if (tid < self->T_subj) {
+		struct perf_t *perf = (self->perf != NULL) ? &self->perf[tid] : NULL;
+		u64 since[PERF_EVENTS];
+		perf_read(perf, since);
+		struct candidates_t *cand = &self->candidates[tid];
+		cand->ctx = ctx;
+		cand->H = self->two_phase ? NULL : ctx->H;
+		while (true) {
+			/* dynamic schedule, chunks of 4 partitions */
+			u32 lo = __atomic_fetch_add(&ctx->next_partition, 4, __ATOMIC_RELAXED);
+			if (lo >= fan_out)
+				break;
+			for (u32 i = lo; i < MIN(lo + 4, fan_out); i++) {
+				u32 T = self->T_part;
+				u64 *L[2][T];
+				u32 n[2][T];
+				struct scattered_t scattered[2];
+				u32 size = 0;
+				for (u32 k = 0; k < 2; k++) {
+					scattered[k].L = L[k];
+					scattered[k].n = n[k];
+					struct side_t *side = &self->side[k];
+					u64 *scratch = side->scratch + ((u64) b) * side->scratch_size;
+					u32 *count = side->count + b * side->count_size;
+					for (u32 t = 0; t < T; t++) {
+						u32 lo = side->psize * i + side->tsize * t;
+						u32 hi = count[t * fan_out + i];
+						scattered[k].L[t] = scratch + lo;
+						scattered[k].n[t] = hi - lo;
+						if (k == 0)
+							size += hi - lo;
+					}
+				}
+				const struct join_engine_t *engine = self->join_engine;
+				if (size > engine->capacity) {
+					engine = self->overflow_engine;
+					__atomic_fetch_add(&self->overflows, 1, __ATOMIC_RELAXED);
+				}
+				engine->join(ctx->slice->l, T, &scattered[0], &scattered[1], cand);
+			}
 		}
+		check_candidates(cand);
+		__atomic_fetch_add(&self->probes, cand->total, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ctx->chck_usec, cand->flush_usec, __ATOMIC_RELAXED);
+		cand->total = 0;
+		cand->flush_usec = 0;
+		perf_add(perf, PERF_JOIN, since);
 	}
+	#pragma omp barrier
 
-	/* probe phase */
-	u64 emitted = 0;
-	for (u32 t = 0; t < T; t++) {
-		u64 *B = partitions[1].L[t];
-		u32 nB = partitions[1].n[t];
-		for (u32 i = 0; i < nB; i++) {
-			u64 y = B[i];
-			u32 h = (y >> shift) & HASH_MASK;
-			u64 x = H[h];
-			while (x != 0) {
-				u64 z = x ^ y;
-				if ((z >> shift) == 0) {
-					preselected[emitted][0] = x;
-					preselected[emitted][1] = y;
-					preselected[emitted][2] = z; 
-					emitted++;
+	/* lift solutions */
+	#pragma omp master
+	{
+		/* the checks are interleaved with the subjoins */
+		long long now = usec();
+		u64 chck_usec = ctx->chck_usec / self->T_subj;
+		self->chck_usec += chck_usec;
+		self->subj_usec += now - self->mark - chck_usec;
+		self->mark = now;
+
+		const struct slice_t *slice = ctx->slice;
+		struct solution_chunk_t *chunk = ctx->result->first;
+		for (; chunk != NULL; chunk = chunk->next)
+			for (u32 i = 0; i < chunk->size; i++) {
+				struct solution_t solution;
+				for (u32 j = 0; j < 3; j++) {
+					solution.val[j] = naive_gemv(chunk->solutions[i].val[j], slice->Minv);
+					solution.task_index[j] = task_index[j];
 				}
-				h = (h + 1) & HASH_MASK;
-				x = H[h];
+				report_solution(self->result, &solution);
 			}
-		}
 	}
-	return emitted;
 }
 
-
-static void checkup(struct slice_ctx_t *ctx, u32 size, u64 (*preselected)[3], u64 *H, bool bad_H)
+/* Process the slices starting at *slice, until end or until (at least)
+   max_slices have been done. A single team of threads lives for the whole
+   range; the phases are separated by barriers. Returns the number of
+   slices processed, and advances *slice. */
+static u32 process_range(struct context_t *self, const struct slice_t **slice,
+			 const u64 *end, u32 max_slices, const u32 *task_index)
 {
-	if (bad_H) {
-		for (u32 i = 0; i < size; i++) {
-			if (linear_lookup(H, preselected[i][2])) {
-				struct solution_t solution;
-				solution.val[0] = preselected[i][0];
-				solution.val[1] = preselected[i][1];
-				solution.val[2] = preselected[i][2];
-				report_solution(ctx->result, &solution);
-      			}
-		}
-	} else {
-		for (u32 i = 0; i < size; i++) {
-			if (cuckoo_lookup(H, preselected[i][2])) {
-				struct solution_t solution;
-				solution.val[0] = preselected[i][0];
-				solution.val[1] = preselected[i][1];
-				solution.val[2] = preselected[i][2];
-				report_solution(ctx->result, &solution);
+	u32 done = 0;
+	#pragma omp parallel num_threads(MAX(self->T_part, self->T_subj))
+	{
+		u32 tid = omp_get_thread_num();
+		struct perf_t *perf = (self->perf != NULL) ? &self->perf[tid] : NULL;
+		/* no-op after the first range of the task (closed at the end) */
+		if (perf != NULL)
+			perf_open(perf);
+		while (true) {
+			/* gather the next batch */
+			#pragma omp single
+			{
+				u32 K = 0;
+				while (K < self->K && done < max_slices && ((const u64 *) *slice) < end) {
+					slice_init(self, &self->batch[K], *slice);
+					self->batch[K].next_partition = 0;
+					self->batch[K].chck_usec = 0;
+					K++;
+					done++;
+
+					const u64 *ptr = ((const u64 *) *slice) + sizeof(**slice) / sizeof(*ptr) + (*slice)->n;
+					*slice = (const struct slice_t *) ptr;
+				}
+				self->batch_size = K;
+				self->mark = usec();
 			}
+			u32 K = self->batch_size;
+			if (K == 0)
+				break;
+
+			/************* phases 1+2: GEMM and partitioning */
+
+			if (tid < self->T_part) {
+				u64 since[PERF_EVENTS];
+				perf_read(perf, since);
+				for (u32 k = 0; k < 2; k++)
+					gemm_partition(self, &self->side[k], K);
+				perf_add(perf, PERF_PARTITION, since);
+			}
+			#pragma omp barrier
+			#pragma omp master
+			{
+				long long now = usec();
+				self->part_usec += now - self->mark;
+				self->mark = now;
+				self->read_volume += self->n[0] + self->n[1];
+			}
+
+			for (u32 b = 0; b < K; b++)
+				slice_join(self, b, task_index);
+
+			/* the next batch overwrites self->batch */
+			#pragma omp barrier
 		}
 	}
+	return done;
 }
 
 
-static void process_slice(struct context_t *self, const struct slice_t *slice,
-		      const u32 *task_index, bool verbose)
+static void context_init(struct context_t *self, const struct jtask_t *task,
+			 struct task_result_t *result)
 {
-	(void) verbose;
-	struct slice_ctx_t ctx = {.slice = slice };
-	ctx.result = result_init();
-	u64 H[512];
-	bool bad_H = cuckoo_build(slice->CM, 0, slice->n, H);
-	if (bad_H)
-		self->bad_slice++;
-	u32 fan_out = 1 << self->p;
-	u64 volume = self->n[0] + self->n[1];
-	self->volume += volume;
-	if (slice->l - self->p < 9)
-		printf("WARNING : l and p are too close (increase l)\n");
-	struct matmul_table_t M;
-	matmul_init(slice->M, &M);
-	
-	/************* phase 1: GEMM */
-
-	long long gemm_start = usec();
-	#pragma omp parallel num_threads(self->T_gemm)
-	{
-		gemm(self->L[0], self->side[0].LM, self->side[0].n, &M);
-		gemm(self->L[1], self->side[1].LM, self->side[1].n, &M);
+	for (u32 k = 0; k < 2; k++) {
+		self->n[k] = task->n[k];
+		self->L[k] = task->L[k];
 	}
-	self->gemm_usec += usec() - gemm_start;
+	self->result = result;
+	self->volume = 0;
+	self->read_volume = 0;
+	self->part_usec = 0;
+	self->subj_usec = 0;
+	self->chck_usec = 0;
+	self->rehashed = 0;
+	self->overflows = 0;
+	self->probes = 0;
+	self->perf = NULL;
+}
 
-	/************* phase 2: partitioning */
+/* allocate everything that depends on the tuning parameters */
+static void context_setup(struct context_t *self, const struct jtune_t *tune, bool verbose)
+{
+	self->T_part = tune->T_part;
+	self->T_subj = tune->T_subj;
+	self->p = tune->p;
+	self->K = tune->K;
+	self->two_phase = tune->two_phase;
+	if (self->T_part == 0 || self->T_subj == 0 || self->K == 0)
+		errx(1, "thread counts and slices per pass must be positive");
+	if (self->p > 24)
+		errx(1, "too many partitioning bits (p=%d)", self->p);
+	self->gemm_engine = gemm_engine_select(tune->gemm);
+	for (u32 k = 0; k < 2; k++)
+		prepare_side(self, k, verbose);
+	/* The Chernoff bound only sizes the scratch space. Hash engines are chosen
+	   while the expected partitions fill at most half of their table; the few
+	   partitions that overflow the engine anyway are detected in phase 3. */
+	u32 expected = self->n[0] >> self->p;
+	self->join_engine = join_engine_select(tune->join, expected, MIN(2 * (u64) expected, UINT32_MAX));
+	self->overflow_engine = join_engine_select("sort", 0, 0);
+	self->lookup_many = cuckoo_lookup_many_select();
+	self->wc = aligned_alloc(CACHE_LINE_SIZE, sizeof(*self->wc) * self->K * self->T_part << self->p);
+	if (self->wc == NULL)
+		err(1, "failed to allocate write-combining buffers");
+	self->batch = malloc(self->K * sizeof(*self->batch));
+	u64 *H = malloc(self->K * CM_TABLE_SIZE * sizeof(*H));
+	struct matmul_table_t *M = aligned_alloc(CACHE_LINE_SIZE, self->K * sizeof(*M));
+	if (self->batch == NULL || H == NULL || M == NULL)
+		err(1, "failed to allocate slice contexts");
+	for (u32 b = 0; b < self->K; b++) {
+		self->batch[b].H = H + b * CM_TABLE_SIZE;
+		self->batch[b].M = M + b;
+		self->batch[b].result = result_init();
+	}
+	self->candidates = malloc(self->T_subj * sizeof(*self->candidates));
+	if (self->candidates == NULL)
+		err(1, "failed to allocate candidate buffers");
+	for (u32 t = 0; t < self->T_subj; t++) {
+		struct candidates_t *cand = &self->candidates[t];
+		cand->buf = aligned_alloc(CACHE_LINE_SIZE, CANDIDATES_SIZE * sizeof(*cand->buf));
+		if (cand->buf == NULL)
+			err(1, "failed to allocate candidate buffers");
+		cand->size = 0;
+		cand->capacity = CANDIDATES_SIZE;
+		cand->total = 0;
+		cand->flush_usec = 0;
+		cand->flush = check_candidates;
+		cand->H = NULL;
+		cand->found = report_candidate;
+		/* a partition of side k holds at most psize items */
+		u32 psize[2] = {self->side[0].psize, self->side[1].psize};
+		cand->scratch_size = psize[0] + psize[1] + MAX(psize[0], psize[1]);
+		cand->scratch = malloc(cand->scratch_size * sizeof(*cand->scratch));
+		if (cand->scratch == NULL)
+			err(1, "failed to allocate sort-merge scratch space");
+	}
+}
 
-	long long part_start = usec();
-	#pragma omp parallel num_threads(self->T_part)
-	{
-		for (u32 k = 0; k < 2; k++)
-			partition(self->p, &self->side[k]);
+static void context_cleanup(struct context_t *self)
+{
+	for (u32 k = 0; k < 2; k++) {
+		free(self->side[k].scratch);
+		free(self->side[k].count);
 	}
-	self->part_usec += usec() - part_start;
-	
-	/************* phase 3: subjoins */
+	for (u32 t = 0; t < self->T_subj; t++) {
+		free(self->candidates[t].buf);
+		free(self->candidates[t].scratch);
+	}
+	free(self->candidates);
+	free(self->wc);
+	free(self->batch[0].H);
+	free(self->batch[0].M);
+	for (u32 b = 0; b < self->K; b++)
+		result_free(self->batch[b].result);
+	free(self->batch);
+}
 
-	long long subj_start = usec();
-	u32 n_preselected[4] = {0, 0, 0, 0};
-	#pragma omp parallel num_threads(self->T_subj)
-	{
-		u32 probes = 0;
-		
-		int tid = omp_get_thread_num();
-		u64 (*preselected)[3] = self->preselected[tid];
-		#pragma omp for schedule(dynamic, 4)
-		for (u32 i = 0; i < fan_out; i++) {
-			u32 T = self->T_part;
-			u64 *L[2][4];
-			u32 n[2][4];
-			struct scattered_t scattered[2];
-			for (u32 k = 0; k < 2; k++) {
-				scattered[k].L = L[k];
-				scattered[k].n = n[k];
-				struct side_t *side = &self->side[k];
-				for (u32 t = 0; t < T; t++) {
-					u32 lo = side->psize * i + side->tsize * t;
-					u32 hi = side->count[t * fan_out + i];
-					scattered[k].L[t] = side->scratch + lo;
-					scattered[k].n[t] = hi - lo;
-				}
+
+/* Autotuning: each candidate setting processes the next batch of slices
+   for real (so no work is wasted), and the setting with the lowest time
+   per slice is kept. Parameters are swept one after the other: p, then
+   T_part, then T_subj. Returns the number of slices processed. */
+static u32 autotune(struct context_t *self, struct jtune_t *tune, const struct slice_t **slice,
+		    const u64 *end, const u32 *task_index)
+{
+	u32 T_max = omp_get_max_threads();
+	u32 l = (*slice)->l;
+	u32 i = 0;
+	for (u32 param = 0; param < 3; param++) {
+		u32 candidates[40];
+		u32 n_candidates = 0;
+		u32 *knob = (param == 0) ? &tune->p : (param == 1) ? &tune->T_part : &tune->T_subj;
+		if (param == 0) {
+			for (u32 p = (tune->p > 2) ? tune->p - 2 : 1; p <= tune->p + 2; p++) {
+				if (p + 9 > l)
+					continue;
+				/* same rule as context_setup() for a forced engine */
+				u64 expected = self->n[0] >> p;
+				if (tune->join != NULL && 2 * expected > join_engine_select(tune->join, 0, 0)->capacity)
+					continue;
+				candidates[n_candidates++] = p;
+			}
+		} else {
+			for (u32 T = 1; T < T_max; T *= 2)
+				candidates[n_candidates++] = T;
+			candidates[n_candidates++] = T_max;
+		}
+
+		u32 best = *knob;
+		double best_rate = INFINITY;
+		for (u32 c = 0; c < n_candidates; c++) {
+			if (((const u64 *) *slice) >= end)
+				break;
+			*knob = candidates[c];
+			context_setup(self, tune, false);
+
+			/* the first batch pays for the page faults in the fresh
+			   scratch space: it is processed, but not timed */
+			i += process_range(self, slice, end, self->K, task_index);
+			double start = wtime();
+			u32 done = process_range(self, slice, end, self->K, task_index);
+			double rate = (done > 0) ? (wtime() - start) / done : INFINITY;
+			context_cleanup(self);
+			i += done;
+			if (tune->verbose)
+				printf("autotune: T_part=%d, T_subj=%d, p=%d, K=%d: %.1fms / slice\n",
+				       tune->T_part, tune->T_subj, tune->p, tune->K, 1e3 * rate);
+			if (rate < best_rate) {
+				best_rate = rate;
+				best = candidates[c];
 			}
-			
-			u32 size = subjoin(&ctx, T, scattered, preselected + probes);
-			probes += size;
 		}
-		n_preselected[tid] = probes;
+		*knob = best;
 	}
-	self->subj_usec += usec() - subj_start;
-	self->probes += n_preselected[0] + n_preselected[1] + n_preselected[2];
+	if (tune->verbose)
+		printf("autotune: keeping T_part=%d, T_subj=%d, p=%d\n", tune->T_part, tune->T_subj, tune->p);
+	return i;
+}
 
-	/************* phase 4: intersection with CM */
 
-	long long chck_start = usec();
-	#pragma omp parallel num_threads(self->T_subj)
-	{
-		int tid = omp_get_thread_num();
-		u64 (*preselected)[3] = self->preselected[tid];
-		checkup(&ctx, n_preselected[tid], preselected, H, bad_H);
+/* Slice-level parallelism: each thread processes whole batches of slices
+   on its own, with private scratch space and single-threaded phases, so
+   the only synchronization is grabbing the next batch. Counters and
+   solutions are merged into self at the end. Timings are averaged over
+   the threads. Returns the number of slices processed.
+
+   This is not cache-blocked: a join needs whole partitions, so each thread
+   partitions all of L and holds about 8 * K * (|A| + |B|) bytes of scratch
+   (plus the Chernoff slack). Memory and DRAM traffic thus grow linearly
+   with the number of threads; this mode only pays off when L is small.
+   There is no autotuning here: the drivers reject --autotune with it. */
+static u32 slice_parallel(struct context_t *self, const struct jtune_t *tune,
+			  const struct jtask_t *task, const u32 *task_index)
+{
+	/* index the slices, so that batches can be handed out */
+	const u64 *end = ((const u64 *) task->slices) + task->slices_size;
+	u32 n_slices = 0;
+	for (const u64 *ptr = (const u64 *) task->slices; ptr < end; n_slices++)
+		ptr += sizeof(struct slice_t) / sizeof(*ptr) + ((const struct slice_t *) ptr)->n;
+	const struct slice_t **index = malloc((n_slices + 1) * sizeof(*index));
+	if (index == NULL)
+		err(1, "failed to allocate slice index");
+	const u64 *ptr = (const u64 *) task->slices;
+	for (u32 i = 0; i <= n_slices; i++) {
+		index[i] = (const struct slice_t *) ptr;
+		if (i < n_slices)
+			ptr += sizeof(struct slice_t) / sizeof(*ptr) + index[i]->n;
 	}
-	self->chck_usec += usec() - chck_start;
 
-	/* lift solutions */
-	struct solution_t * loc = ctx.result->solutions;
-	u32 n_sols = ctx.result->size;
-	for (u32 i = 0; i < n_sols; i++) {
-		struct solution_t solution;
-		for (u32 j = 0; j < 3; j++) {
-			solution.val[j] = naive_gemv(loc[i].val[j], slice->Minv);
-			solution.task_index[j] = task_index[j];
+	struct jtune_t worker_tune = *tune;
+	worker_tune.T_part = 1;
+	worker_tune.T_subj = 1;
+	u32 T = tune->slice_threads;
+	u32 K = tune->K;
+	u32 n_batches = (n_slices + K - 1) / K;
+
+	#pragma omp parallel num_threads(T)
+	{
+		struct context_t local;
+		context_init(&local, task, result_init());
+		if (self->perf != NULL)
+			local.perf = self->perf + omp_get_thread_num();
+		context_setup(&local, &worker_tune, false);
+		#pragma omp master
+		if (tune->verbose) {
+			u64 scratch = K * (local.side[0].scratch_size + local.side[1].scratch_size) * sizeof(u64);
+			printf("Slice-parallel: %d threads, %.1f Mbyte of scratch each\n", T, scratch / 1048576.0);
+		}
+
+		#pragma omp for schedule(dynamic, 1)
+		for (u32 b = 0; b < n_batches; b++) {
+			const struct slice_t *slice = index[b * K];
+			u64 *hi = (u64 *) index[MIN(n_slices, (b + 1) * K)];
+			process_range(&local, &slice, hi, K, task_index);
+		}
+
+		context_cleanup(&local);
+		#pragma omp critical
+		{
+			self->volume += local.volume;
+			self->read_volume += local.read_volume;
+			self->probes += local.probes;
+			self->rehashed += local.rehashed;
+			self->overflows += local.overflows;
+			self->gemm_engine = local.gemm_engine;
+			self->join_engine = local.join_engine;
+			self->overflow_engine = local.overflow_engine;
+			self->part_usec += local.part_usec / T;
+			self->subj_usec += local.subj_usec / T;
+			self->chck_usec += local.chck_usec / T;
+			result_merge(self->result, local.result);
 		}
-		report_solution(self->result, &solution);
+		result_free(local.result);
 	}
-	result_free(ctx.result);
+	free(index);
+
+	/* for the report */
+	self->T_part = T;
+	self->T_subj = T;
+	self->K = K;
+	return n_slices;
 }
 
 
+void jtune_defaults(struct jtune_t *tune)
+{
+	/* tuned for the BG/Q */
+	tune->T_part = 2;
+	tune->T_subj = 3;
+	tune->p = 10;
+	tune->K = 4;
+	tune->gemm = NULL;
+	tune->join = NULL;
+	tune->slice_threads = 0;
+	tune->two_phase = false;
+	tune->autotune = false;
+	tune->verbose = false;
+	tune->perf = NULL;
+}
+
 
-struct task_result_t *iterated_joux_task(struct jtask_t *task, const u32 *task_index)
+struct task_result_t *iterated_joux_task(struct jtask_t *task, const u32 *task_index,
+					 const struct jtune_t *tune_)
 {
-	static const bool task_verbose = false;
-	static const bool slice_verbose = false;
+	struct jtune_t tune = *tune_;
+	bool task_verbose = tune.verbose;
 	
 	/* setup */
-	static const u32 p = 10;	// hardcodé !
 	struct task_result_t *result = result_init();
 	double start = wtime();
 	struct context_t self;
-	for (u32 k = 0; k < 2; k++) {
-		self.n[k] = task->n[k];
-		self.L[k] = task->L[k];
+	context_init(&self, task, result);
+	u32 perf_threads = MAX((u32) omp_get_max_threads(), MAX(tune.slice_threads, MAX(tune.T_part, tune.T_subj)));
+	if (tune.perf != NULL) {
+		self.perf = malloc(perf_threads * sizeof(*self.perf));
+		if (self.perf == NULL)
+			err(1, "cannot allocate hardware counters");
+		for (u32 t = 0; t < perf_threads; t++)
+			perf_init(&self.perf[t]);
 	}
-	self.T_gemm = 4;
-	self.T_part = 2;
-	self.T_subj = 3;
-	self.p = p;
-	self.result = result;
-	for (u32 k = 0; k < 2; k++)
-		prepare_side(&self, k, task_verbose);
-	for (u32 t = 0; t < self.T_subj; t++)
-		self.preselected[t] = malloc(task->n[0] * 24);
-	self.volume = 0;
-	self.gemm_usec = 0;
-	self.part_usec = 0;
-	self.subj_usec = 0;
-	self.chck_usec = 0;
-	self.bad_slice = 0;
-	self.probes = 0;
 
 	if (task_verbose) {
 		/* task-level */
@@ -406,46 +721,65 @@ struct task_result_t *iterated_joux_task(struct jtask_t *task, const u32 *task_i
 		double mbytes = 8 * (task->n[0] + task->n[1]) / 1048576.0;
 		printf("Volume. Hash = %.1fMbyte + Slice = %.1fMbyte\n", 
 			mbytes, task->slices_size / 1048576.0);
+		double part_size = task->n[0] / ((double) (1 << tune.p));
 		printf("Partition size (A): %.0f elements (hash fill=%.0f%%)\n", 
-			task->n[0] / 1024., task->n[0] / 5242.88);
+			part_size, part_size / 5.12);
 	}
 	
 	/* process all slices */
-	struct slice_t *slice = task->slices;
+	const struct slice_t *slice = task->slices;
 	u32 i = 0;
-	u64 *end = ((u64 *) task->slices) + task->slices_size;
-	while (((u64 *) slice) < end) {
-		process_slice(&self, slice, task_index, slice_verbose);
-		i++;
-		
-		u64 *ptr = ((u64 *) slice) + sizeof(*slice) / sizeof(*ptr) + slice->n;
-		slice = (struct slice_t *) ptr;
-	}
+	const u64 *end = ((const u64 *) task->slices) + task->slices_size;
+	if (tune.slice_threads > 0) {
+		i = slice_parallel(&self, &tune, task, task_index);
+	} else {
+		if (tune.autotune && ((const u64 *) slice) < end)
+			i += autotune(&self, &tune, &slice, end, task_index);
+		context_setup(&self, &tune, task_verbose);
+		i += process_range(&self, &slice, end, UINT32_MAX, task_index);
 
-	/* cleanup */
-	for (u32 k = 0; k < 2; k++) {
-		free(self.side[k].scratch);
-		free(self.side[k].LM);
-		free(self.side[k].count);
+		/* cleanup */
+		context_cleanup(&self);
 	}
-	for (u32 t = 0; t < self.T_subj; t++)
-		free(self.preselected[t]);
 
 	if (task_verbose) {
 		double task_duration = wtime() - start;
 		double Mvolume = self.volume * 9.5367431640625e-07;
-		printf("Slices: %d (%d bad ones)\n", i, self.bad_slice);
+		printf("Slices: %d (%d with a rehashed CM table)\n", i, self.rehashed);
+		if (self.overflows > 0)
+			printf("Partitions too large for %s: %d (joined by %s)\n",
+			       self.join_engine->name, self.overflows, self.overflow_engine->name);
 		printf("Task duration: %.1f s\n", task_duration);
 		printf("Total volume: %.1fMitem\n", Mvolume);
 		printf("Breakdown:\n");
-		printf("* GEMM:      \tT = %d, \ttime = %.2fs\trate = %.2fMitem/s\n",
-		     self.T_gemm, 1e-6 * self.gemm_usec, self.volume / (self.gemm_usec / 1.048576));
-		printf("* partition: \tT = %d, \ttime = %.2fs\trate = %.2fMitem/s\n",
-		     self.T_part, 1e-6 * self.part_usec, self.volume / (self.part_usec / 1.048576));
-		printf("* subjoin:   \tT = %d, \ttime = %.2fs\trate = %.2fMitem/s\n",
-		     self.T_subj, 1e-6 * self.subj_usec, self.volume / (self.subj_usec / 1.048576));
+		printf("* GEMM (%s) + partition: \tT = %d, K = %d\ttime = %.2fs\trate = %.2fMitem/s\n",
+		     self.gemm_engine->name, self.T_part, self.K, 1e-6 * self.part_usec,
+		     self.volume / (self.part_usec / 1.048576));
+		printf("         \tL read at %.2f GB/s, effective %.2f GB/s (%.2f slices per pass)\n",
+		     8e-3 * self.read_volume / self.part_usec, 8e-3 * self.volume / self.part_usec,
+		     ((double) self.volume) / self.read_volume);
+		printf("* subjoin (%s):\tT = %d, \ttime = %.2fs\trate = %.2fMitem/s\n",
+		     self.join_engine->name, self.T_subj, 1e-6 * self.subj_usec, self.volume / (self.subj_usec / 1.048576));
 		printf("         \tprobes = %.2fM\t\t%.2f x expected \n", 9.5367431640625e-07 * self.probes, self.probes / ((double) self.n[0] * self.n[1] * i / 524288.));
-		printf("         \t\ttime = %.2fs\trate = %.2fMitem/s\n", 1e-6 * self.chck_usec, self.probes / (self.chck_usec / 1.048576));
+		if (self.chck_usec > 0)
+			printf("         \t\ttime = %.2fs\trate = %.2fMitem/s\n", 1e-6 * self.chck_usec, self.probes / (self.chck_usec / 1.048576));
+		else
+			printf("         \t\tchecked inline\n");
+	}
+
+	if (self.perf != NULL) {
+		/* the checks happen inside the joins: report them separately */
+		for (u32 t = 0; t < perf_threads; t++) {
+			perf_close(&self.perf[t]);
+			for (u32 e = 0; e < PERF_EVENTS; e++)
+				self.perf[t].count[PERF_JOIN][e] -= self.perf[t].count[PERF_CHECK][e];
+		}
+		FILE *f = fopen(tune.perf, "a");
+		if (f == NULL)
+			err(1, "cannot open %s", tune.perf);
+		perf_json(f, task_index, self.perf, perf_threads);
+		fclose(f);
+		free(self.perf);
 	}
 	return result;
 }
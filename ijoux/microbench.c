@@ -0,0 +1,246 @@
+#define _XOPEN_SOURCE 500   /* lrand48 */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <getopt.h>
+
+#include "common.h"
+#include "gemm.h"
+#include "join.h"
+
+void usage()
+{
+	printf("--n=N                   Number of items (default 1048576)\n");
+	printf("--rounds=R              Number of repetitions (default 16)\n");
+	printf("--part=P                Items per partition in the join benchmark (default 100)\n\n");
+}
+
+static u64 myrand()
+{
+	u64 a = lrand48();
+	u64 b = lrand48();
+	u64 c = lrand48();
+	return a + (b << 31) + (c << 62);
+}
+
+/* compare all the GEMM engines available on this CPU against naive_gemv */
+void bench_gemm(u32 n, u32 rounds)
+{
+	u64 M[64];
+	for (u32 i = 0; i < 64; i++)
+		M[i] = myrand();
+	struct matmul_table_t *T = aligned_alloc(64, sizeof(*T));
+	u64 *IN = aligned_alloc(64, n * sizeof(u64));
+	u64 *OUT = aligned_alloc(64, n * sizeof(u64));
+	u64 *REF = aligned_alloc(64, n * sizeof(u64));
+	if (T == NULL || IN == NULL || OUT == NULL || REF == NULL)
+		err(1, "cannot allocate benchmark data");
+	for (u32 i = 0; i < n; i++)
+		IN[i] = myrand();
+	matmul_init(M, T);
+
+	printf("GEMM, %d items x %d rounds\n", n, rounds);
+	double start = wtime();
+	for (u32 r = 0; r < rounds; r++)
+		for (u32 i = 0; i < n; i++)
+			REF[i] = naive_gemv(IN[i] ^ r, M);
+	double ref_rate = 1e-6 * n * rounds / (wtime() - start);
+	printf("* %-10s %8.1f Mitem/s\n", "naive", ref_rate);
+	for (u32 i = 0; i < n; i++)
+		REF[i] = naive_gemv(IN[i], M);
+
+	for (const struct gemm_engine_t *e = gemm_engines; e->name != NULL; e++) {
+		if (!e->supported()) {
+			printf("* %-10s not supported\n", e->name);
+			continue;
+		}
+		/* odd sizes exercise the tail handling */
+		e->gemm(IN, OUT, n - 3, T);
+		for (u32 i = 0; i < n - 3; i++)
+			if (OUT[i] != REF[i])
+				errx(1, "engine %s: wrong result for item %d", e->name, i);
+
+		start = wtime();
+		for (u32 r = 0; r < rounds; r++)
+			e->gemm(IN, OUT, n, T);
+		double rate = 1e-6 * n * rounds / (wtime() - start);
+		printf("* %-10s %8.1f Mitem/s\t(x %.1f)\n", e->name, rate, rate / ref_rate);
+	}
+	printf("default engine (calibrated): %s\n", gemm_engine_select(NULL)->name);
+	free(T);
+	free(IN);
+	free(OUT);
+	free(REF);
+}
+
+/* accumulates an order-independent digest of the output of a join engine */
+static void join_digest(struct candidates_t *c)
+{
+	u64 *d = c->ctx;
+	for (u32 i = 0; i < c->size; i++)
+		*d += (c->buf[i][0] * 0x9e3779b97f4a7c15ull) ^ c->buf[i][1];
+	c->size = 0;
+}
+
+/* compare all the join engines available on this CPU against the first
+   one, on partitions of part items (about 100 with p = 10) */
+void bench_join(u32 n, u32 rounds, u32 part)
+{
+	static const u32 l = 12;
+	u32 n_parts = n / (2 * part);
+	u64 *A = aligned_alloc(64, n_parts * part * sizeof(u64));
+	u64 *B = aligned_alloc(64, n_parts * part * sizeof(u64));
+	u64 (*buf)[3] = malloc(1024 * sizeof(*buf));
+	u64 *scratch = malloc(3 * part * sizeof(*scratch));
+	if (A == NULL || B == NULL || buf == NULL || scratch == NULL)
+		err(1, "cannot allocate benchmark data");
+	for (u32 i = 0; i < n_parts * part; i++) {
+		A[i] = myrand();
+		B[i] = myrand();
+	}
+
+	/* partition i is A[i * part : (i + 1) * part] x the same in B */
+	printf("join, %d x %d items x %d rounds, l = %d\n", n_parts, 2 * part, rounds, l);
+	bool have_ref = false;
+	u64 ref_digest = 0;
+	u64 ref_size = 0;
+	for (const struct join_engine_t *e = join_engines; e->name != NULL; e++) {
+		if (!e->supported()) {
+			printf("* %-10s not supported\n", e->name);
+			continue;
+		}
+		if (part > e->capacity) {
+			printf("* %-10s partitions too large\n", e->name);
+			continue;
+		}
+		u64 digest = 0;
+		struct candidates_t out = {buf, 0, 1024, 0, 0, join_digest, NULL, NULL, &digest,
+					  scratch, 3 * part};
+		double start = wtime();
+		for (u32 r = 0; r < rounds; r++)
+			for (u32 i = 0; i < n_parts; i++) {
+				u64 *LA = A + i * part;
+				u64 *LB = B + i * part;
+				u32 nA = part, nB = part;
+				struct scattered_t SA = {&LA, &nA};
+				struct scattered_t SB = {&LB, &nB};
+				e->join(l, 1, &SA, &SB, &out);
+			}
+		join_digest(&out);
+		u64 size = out.total;
+		double rate = 1e-6 * n_parts * 2 * part * rounds / (wtime() - start);
+		if (!have_ref) {
+			have_ref = true;
+			ref_digest = digest;
+			ref_size = size;
+		} else if (digest != ref_digest || size != ref_size) {
+			errx(1, "engine %s: wrong result", e->name);
+		}
+		printf("* %-10s %8.1f Mitem/s\t(%" PRId64 " pairs)\n", e->name, rate, size / rounds);
+	}
+	free(A);
+	free(B);
+	free(buf);
+	free(scratch);
+}
+
+/* compare batched cuckoo lookups against the one-at-a-time loop of checkup(),
+   on a table holding 200 items (a typical CM), half of the queries hitting */
+void bench_cuckoo(u32 n, u32 rounds)
+{
+	static const u32 CM_SIZE = 200;
+	u64 CM[CM_SIZE];
+	u64 H[CM_TABLE_SIZE];
+	for (u32 i = 0; i < CM_SIZE; i++)
+		CM[i] = myrand();
+	cuckoo_build(CM, 0, CM_SIZE, 64, H);
+	u64 *Q = aligned_alloc(64, n * sizeof(u64));
+	u8 *REF = malloc(n);
+	if (Q == NULL || REF == NULL)
+		err(1, "cannot allocate benchmark data");
+	for (u32 i = 0; i < n; i++)
+		Q[i] = (i & 1) ? CM[lrand48() % CM_SIZE] : myrand();
+
+	printf("cuckoo lookups, %d items x %d rounds\n", n, rounds);
+	u64 hits = 0;
+	double start = wtime();
+	for (u32 r = 0; r < rounds; r++)
+		for (u32 i = 0; i < n; i++) {
+			REF[i] = cuckoo_lookup(H, Q[i]);
+			hits += REF[i];
+		}
+	double ref_rate = 1e-6 * n * rounds / (wtime() - start);
+	printf("* %-10s %8.1f Mlookup/s\t(%.1f%% hits)\n", "one-by-one", ref_rate, 100.0 * hits / n / rounds);
+
+	struct {
+		const char *name;
+		cuckoo_lookup_many_t lookup_many;
+	} engines[2] = {{"scalar", cuckoo_lookup_many_scalar}, {"avx2", NULL}};
+#ifdef CUCKOO_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		engines[1].lookup_many = cuckoo_lookup_many_avx2;
+#endif
+	for (u32 k = 0; k < 2; k++) {
+		if (engines[k].lookup_many == NULL) {
+			printf("* %-10s not supported\n", engines[k].name);
+			continue;
+		}
+		u32 check = 0;
+		start = wtime();
+		for (u32 r = 0; r < rounds; r++)
+			for (u32 i = 0; i < n; i += 8) {
+				u32 m = MIN(8, n - i);
+				u32 mask = engines[k].lookup_many(H, Q + i, m);
+				if (r == 0)
+					for (u32 j = 0; j < m; j++)
+						check |= ((mask >> j) & 1) ^ REF[i + j];
+			}
+		double rate = 1e-6 * n * rounds / (wtime() - start);
+		if (check)
+			errx(1, "cuckoo_lookup_many (%s): wrong result", engines[k].name);
+		printf("* %-10s %8.1f Mlookup/s\t(x %.1f)\n", engines[k].name, rate, rate / ref_rate);
+	}
+	free(Q);
+	free(REF);
+}
+
+int main(int argc, char **argv)
+{
+	struct option longopts[4] = {
+		{"n", required_argument, NULL, 'n'},
+		{"rounds", required_argument, NULL, 'r'},
+		{"part", required_argument, NULL, 'p'},
+		{NULL, 0, NULL, 0}
+	};
+	u32 n = 1048576;
+	u32 rounds = 16;
+	u32 part = 100;
+	signed char ch;
+	while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'p':
+			part = atoi(optarg);
+			break;
+		default:
+			usage();
+			errx(1, "Unknown option\n");
+		}
+	}
+	if (n < 8)
+		errx(1, "--n must be at least 8");
+	if (part == 0 || 2 * part > n)
+		errx(1, "--part must be between 1 and n/2");
+
+	srand48(1337);
+	bench_gemm(n, rounds);
+	bench_join(n, rounds, part);
+	bench_cuckoo(n, rounds);
+}
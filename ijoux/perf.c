@@ -0,0 +1,159 @@
+#define _GNU_SOURCE	/* syscall */
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <inttypes.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf.h"
+
+static const char *event_name[PERF_EVENTS] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+static const char *phase_name[PERF_PHASES] = {"partition", "join", "check"};
+
+void perf_init(struct perf_t *perf)
+{
+	for (u32 e = 0; e < PERF_EVENTS; e++) {
+		perf->fd[e] = -1;
+		perf->slot[e] = -1;
+	}
+	perf->owner = 0;
+	perf->multiplexed = false;
+	memset(perf->count, 0, sizeof(perf->count));
+}
+
+static long thread_id()
+{
+#ifdef __linux__
+	return syscall(SYS_gettid);
+#else
+	return 1;
+#endif
+}
+
+#ifdef __linux__
+static int event_open(u32 type, u64 config, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+			 | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/* start counting for the calling thread, unless it already does. The
+   counters follow the thread that opens them: if another thread now uses
+   perf, they are reopened. Returns false if not possible */
+bool perf_open(struct perf_t *perf)
+{
+	long tid = thread_id();
+	if (perf->owner == tid)
+		return perf->fd[PERF_CYCLES] >= 0;
+	perf_close(perf);
+	perf->owner = tid;
+#ifdef __linux__
+	static const struct { u32 type; u64 config; } events[PERF_EVENTS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+					| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+					| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	};
+	int n = 0;
+	for (u32 e = 0; e < PERF_EVENTS; e++) {
+		int fd = event_open(events[e].type, events[e].config, perf->fd[PERF_CYCLES]);
+		if (fd < 0) {
+			if (e == 0)
+				break;	/* no leader: no counters at all */
+			continue;	/* this event is not supported */
+		}
+		perf->fd[e] = fd;
+		perf->slot[e] = n++;
+	}
+#endif
+	if (perf->fd[PERF_CYCLES] < 0) {
+		static bool warned = false;
+		#pragma omp critical(perf_warning)
+		if (!warned) {
+			warnx("hardware counters are not available (perf_event_paranoid?)");
+			warned = true;
+		}
+		return false;
+	}
+	return true;
+}
+
+/* each member of the group has its own file descriptor */
+void perf_close(struct perf_t *perf)
+{
+	for (u32 e = 0; e < PERF_EVENTS; e++) {
+		if (perf->fd[e] >= 0)
+			close(perf->fd[e]);
+		perf->fd[e] = -1;
+		perf->slot[e] = -1;
+	}
+	perf->owner = 0;
+}
+
+/* the counts are scaled by time_enabled / time_running when the group did
+   not have the counters all the time */
+void perf_read(struct perf_t *perf, u64 *now)
+{
+	for (u32 e = 0; e < PERF_EVENTS; e++)
+		now[e] = 0;
+	if (perf == NULL || perf->fd[PERF_CYCLES] < 0)
+		return;
+	u64 buffer[3 + PERF_EVENTS];	/* nr, time_enabled, time_running, values */
+	if (read(perf->fd[PERF_CYCLES], buffer, sizeof(buffer)) < (ssize_t) (3 * sizeof(u64)))
+		return;
+	u64 enabled = buffer[1];
+	u64 running = buffer[2];
+	if (running == 0)
+		return;
+	double scale = 1;
+	if (running < enabled) {
+		scale = ((double) enabled) / running;
+		perf->multiplexed = true;
+	}
+	for (u32 e = 0; e < PERF_EVENTS; e++)
+		if (perf->slot[e] >= 0 && (u64) perf->slot[e] < buffer[0])
+			now[e] = buffer[3 + perf->slot[e]] * scale;
+}
+
+/* accumulate what happened since the given reading in the phase */
+void perf_add(struct perf_t *perf, enum perf_phase_t phase, const u64 *since)
+{
+	if (perf == NULL || perf->fd[PERF_CYCLES] < 0)
+		return;
+	u64 now[PERF_EVENTS];
+	perf_read(perf, now);
+	for (u32 e = 0; e < PERF_EVENTS; e++)
+		perf->count[phase][e] += now[e] - since[e];
+}
+
+/* one line of JSON with the counters of threads 0..T-1 for a task */
+void perf_json(FILE *f, const u32 *task_index, const struct perf_t *perf, u32 T)
+{
+	fprintf(f, "{\"task\": [%u, %u, %u], \"threads\": [", task_index[0], task_index[1], task_index[2]);
+	for (u32 t = 0; t < T; t++) {
+		fprintf(f, "%s{", (t > 0) ? ", " : "");
+		for (u32 p = 0; p < PERF_PHASES; p++) {
+			fprintf(f, "%s\"%s\": {", (p > 0) ? ", " : "", phase_name[p]);
+			for (u32 e = 0; e < PERF_EVENTS; e++)
+				fprintf(f, "%s\"%s\": %" PRIu64, (e > 0) ? ", " : "", event_name[e], perf[t].count[p][e]);
+			fprintf(f, "}");
+		}
+		fprintf(f, ", \"multiplexed\": %s}", perf[t].multiplexed ? "true" : "false");
+	}
+	fprintf(f, "]}\n");
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include "../types.h"
+
+/* Hardware counters of a thread (cycles, instructions, LLC and DTLB misses),
+   read with perf_event_open and accumulated over the phases of the
+   processing of a slice. If the counters are not available (kernel settings,
+   virtual machines, not Linux), everything reads as zero. The group is
+   opened once per thread and per task. When the kernel has to multiplex it
+   with other events, the counts are scaled up and the thread is flagged. */
+
+enum perf_event_t { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_DTLB_MISSES, PERF_EVENTS };
+enum perf_phase_t { PERF_PARTITION, PERF_JOIN, PERF_CHECK, PERF_PHASES };
+
+struct perf_t {
+	int fd[PERF_EVENTS];		/* members of the group (cycles leads), or -1 */
+	int slot[PERF_EVENTS];		/* position in the group, or -1 */
+	long owner;			/* thread that opened the group, or 0 */
+	bool multiplexed;		/* some readings had to be scaled */
+	u64 count[PERF_PHASES][PERF_EVENTS];
+};
+
+void perf_init(struct perf_t *perf);
+bool perf_open(struct perf_t *perf);
+void perf_close(struct perf_t *perf);
+void perf_read(struct perf_t *perf, u64 *now);
+void perf_add(struct perf_t *perf, enum perf_phase_t phase, const u64 *since);
+void perf_json(FILE *f, const u32 *task_index, const struct perf_t *perf, u32 T);
@@ -134,14 +134,18 @@ int main(int argc, char **argv)
 		u64 mask = LEFT_MASK(slice->l);
 		u64 n = slice->n;
 
+		u64 SM[64], SMinv[64];    /* slice_t is packed: work on aligned copies */
+		memcpy(SM, slice->M, sizeof(SM));
+		memcpy(SMinv, slice->Minv, sizeof(SMinv));
+
 		for (u64 k = 0; k < 64; k++) {
-			assert(naive_gemv(slice->M[k], slice->Minv) == 1ull << k);
-			assert(naive_gemv(slice->Minv[k], slice->M) == 1ull << k);
+			assert(naive_gemv(SM[k], SMinv) == 1ull << k);
+			assert(naive_gemv(SMinv[k], SM) == 1ull << k);
 		}
 
 		for (u64 k = 0; k < n; k++) {
 			assert((slice->CM[k] & mask) == 0);
-			u64 z = naive_gemv(slice->CM[k], slice->Minv);
+			u64 z = naive_gemv(slice->CM[k], SMinv);
 			if (!binary_search(z, L, n_hashes)) {
 				printf("Mismatch in slice #%" PRId64 ": item %" PRId64 " (%016" PRIx64 ") is not in L\n", i, k, z);
 				exit(EXIT_FAILURE);
@@ -12,6 +12,10 @@
 #include <arpa/inet.h>
 #include <byteswap.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include <mpi.h>
 
 #include "preprocessing.h"
@@ -63,55 +67,32 @@ u64 * load(const char *filename, u64 *size_)
 	return content;
 }
 
-static const u32 MAX_ISD_ITERATIONS = 100;
-
-struct list_t {
-	u64 x;
-	struct list_t *next, *prev;
-};
-
-struct list_t *active, *reject;
+/* The vectors that remain to be sliced. The active ones are vectors[0:m];
+   the rejected ones follow. */
+u64 *vectors;
 u32 m;
 
-
-static void list_insert(struct list_t *list, struct list_t *item)
-{
-	item->next = list->next;
-	item->prev = list;
-	item->next->prev = item;
-	item->prev->next = item;        
-}
-
-static void list_remove(struct list_t *item)
-{
-	item->next->prev = item->prev;
-	item->prev->next = item->next;
-}
-
-static void list_clear(struct list_t *item)
-{
-	assert(item->x == 0);
-	item->next = item;
-	item->prev = item;
-}
-
 static inline bool satisfy_equation(u64 x, u64 eq)
 {
 	return (__builtin_popcountll(x & eq) & 1) == 0;
 }
 
-void filter_active(u64 eq)
+/* Stable partition of the active vectors: those that satisfy eq stay in front,
+   the others move right after them. scratch must hold m words. */
+void filter_active(u64 eq, u64 *scratch)
 {
-	struct list_t *item = active->next;
-	while (item != active) {
-		struct list_t *next = item->next;      /* we have to save this before modifying it */
-		if (!satisfy_equation(item->x, eq)) {
-			list_remove(item);
-			list_insert(reject, item);
-			m--;
-		}
-		item = next;    
+	u32 j = 0;
+	u32 r = 0;
+	for (u32 i = 0; i < m; i++) {
+		u64 x = vectors[i];
+		bool ok = satisfy_equation(x, eq);
+		vectors[j] = x;
+		scratch[r] = x;
+		j += ok;
+		r += !ok;
 	}
+	memcpy(vectors + j, scratch, r * sizeof(*scratch));
+	m = j;
 }
 
 double H(double x) {
@@ -167,7 +148,7 @@ static const uint64_t M6_LO = 0x5555555555555555;
   "algorithmic cryptanalysis" (cf. http://www.joux.biz). It
   was slighlty modified by C. Bouillaguet. Just like the original, it is licensed 
   under a Creative Commons Attribution-Noncommercial-Share Alike 3.0 Unported License. */
-void transpose_64(const u64 *M, u64 *T)
+static void scalar_transpose_64(const u64 *M, u64 *T)
 {
 	/* to unroll manually */
 	for (int l = 0; l < 32; l++) {
@@ -216,6 +197,71 @@ void transpose_64(const u64 *M, u64 *T)
 
 }
 
+#ifdef __x86_64__
+static bool avx2_supported()
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* Same swap network, on 16 registers of 4 rows. The first four stages pair
+   whole registers; the last two pair lanes inside a register. */
+__attribute__ ((target("avx2")))
+static void avx2_transpose_64(const u64 *M, u64 *T)
+{
+	static const u64 LO[6] = {M1_LO, M2_LO, M3_LO, M4_LO, M5_LO, M6_LO};
+	static const u64 HI[6] = {M1_HI, M2_HI, M3_HI, M4_HI, M5_HI, M6_HI};
+	__m256i v[16];
+	for (int i = 0; i < 16; i++)
+		v[i] = _mm256_loadu_si256((__m256i *) (M + 4 * i));
+
+	for (int q = 0; q < 4; q++) {
+		int s = 32 >> q;
+		int d = s / 4;        /* distance in registers */
+		__m128i count = _mm_cvtsi32_si128(s);
+		__m256i lo = _mm256_set1_epi64x(LO[q]);
+		__m256i hi = _mm256_set1_epi64x(HI[q]);
+		for (int a0 = 0; a0 < 16; a0 += 2 * d)
+			for (int a = a0; a < a0 + d; a++) {
+				__m256i x = v[a];
+				__m256i y = v[a + d];
+				v[a] = _mm256_or_si256(_mm256_and_si256(x, lo), _mm256_sll_epi64(_mm256_and_si256(y, lo), count));
+				v[a + d] = _mm256_or_si256(_mm256_srl_epi64(_mm256_and_si256(x, hi), count), _mm256_and_si256(y, hi));
+			}
+	}
+
+	__m256i lo5 = _mm256_set1_epi64x(M5_LO);
+	__m256i hi5 = _mm256_set1_epi64x(M5_HI);
+	__m256i lo6 = _mm256_set1_epi64x(M6_LO);
+	__m256i hi6 = _mm256_set1_epi64x(M6_HI);
+	for (int a = 0; a < 16; a++) {
+		/* rows (0, 2) and (1, 3) */
+		__m256i x = v[a];
+		__m256i y = _mm256_permute4x64_epi64(x, 0x4e);
+		__m256i l = _mm256_or_si256(_mm256_and_si256(x, lo5), _mm256_slli_epi64(_mm256_and_si256(y, lo5), 2));
+		__m256i h = _mm256_or_si256(_mm256_srli_epi64(_mm256_and_si256(y, hi5), 2), _mm256_and_si256(x, hi5));
+		x = _mm256_blend_epi32(l, h, 0xf0);
+
+		/* rows (0, 1) and (2, 3) */
+		y = _mm256_permute4x64_epi64(x, 0xb1);
+		l = _mm256_or_si256(_mm256_and_si256(x, lo6), _mm256_slli_epi64(_mm256_and_si256(y, lo6), 1));
+		h = _mm256_or_si256(_mm256_srli_epi64(_mm256_and_si256(y, hi6), 1), _mm256_and_si256(x, hi6));
+		x = _mm256_blend_epi32(l, h, 0xcc);
+		_mm256_storeu_si256((__m256i *) (T + 4 * a), x);
+	}
+}
+#endif
+
+/* selected at startup by setup_engines() */
+static void (*transpose_64)(const u64 *M, u64 *T) = scalar_transpose_64;
+
+static void setup_engines()
+{
+#ifdef __x86_64__
+	if (avx2_supported())
+		transpose_64 = avx2_transpose_64;
+#endif
+}
+
 void print_matrix(int n, int m, u64 *M)
 {
 	for (int i = 0; i < n; i++) {
@@ -229,13 +275,18 @@ void print_matrix(int n, int m, u64 *M)
 	}
 }
 
+/* blocks of 8 are transposed before being written, so that each row of T
+   receives a full cache line at a time */
 void transpose(const u64 *M, u32 w, u64 *T)
 {
-	for (u32 i = 0; i < w; i++) {
-		u64 S[64];
-		transpose_64(M + i*64, S);
+	for (u32 i = 0; i < w; i += 8) {
+		u32 b = (w - i < 8) ? w - i : 8;
+		u64 S[8][64];
+		for (u32 k = 0; k < b; k++)
+			transpose_64(M + (i + k) * 64, S[k]);
 		for (u32 j = 0; j < 64; j++)
-			T[i + j * w] = S[j];
+			for (u32 k = 0; k < b; k++)
+				T[i + k + j * w] = S[k][j];
 	}
 }
 
@@ -254,46 +305,104 @@ void swap_columns(u64 *T, u32 w, u64 j, u64 l)
 	}
 }
 
+/* T <-- E * T, where T has 64 rows of w words and E is 64x64 (row i of the
+   result is the XOR of the rows of T selected by E[i]). Method of the Four
+   Russians: the rows are grouped by 4, and the 16 combinations of each group
+   are tabulated in Gray-code order, one block of M4RI_WORDS words at a time.
+   This works in-place because each block only depends on itself. */
+#define M4RI_WORDS 8
+
+static void m4ri_apply(u64 *T, u32 w, const u64 *E)
+{
+	u64 tables[16][16][M4RI_WORDS];
+	for (u32 c = 0; c < w; c += M4RI_WORDS) {
+		u32 b = (w - c < M4RI_WORDS) ? w - c : M4RI_WORDS;
+		for (u32 q = 0; q < 16; q++) {
+			for (u32 t = 0; t < b; t++)
+				tables[q][0][t] = 0;
+			for (u32 i = 1; i < 16; i++) {
+				u32 g = i ^ (i >> 1);
+				u32 p = (i - 1) ^ ((i - 1) >> 1);
+				const u64 *row = T + (4 * q + __builtin_ctz(g ^ p)) * w + c;
+				for (u32 t = 0; t < b; t++)
+					tables[q][g][t] = tables[q][p][t] ^ row[t];
+			}
+		}
+		for (u32 r = 0; r < 64; r++) {
+			u64 acc[M4RI_WORDS] = {0};
+			for (u32 q = 0; q < 16; q++) {
+				const u64 *x = tables[q][(E[r] >> (4 * q)) & 15];
+				for (u32 t = 0; t < M4RI_WORDS; t++)
+					acc[t] ^= x[t];
+			}
+			for (u32 t = 0; t < b; t++)
+				T[r * w + c + t] = acc[t];
+		}
+	}
+}
+
+/* the o-th column of T (64 rows of w words) */
+static u64 get_column(const u64 *T, u32 w, u32 o)
+{
+	u32 ow = o / 64;
+	u32 obit = o % 64;
+	u64 col = 0;
+	for (u32 i = 0; i < 64; i++)
+		col |= ((T[i * w + ow] >> obit) & 1) << i;
+	return col;
+}
+
+/* rows [lo:hi] of E * col */
+static u64 apply_column(const u64 *E, u64 col, u32 lo, u32 hi)
+{
+	u64 x = 0;
+	for (u32 i = lo; i < hi; i++)
+		x |= ((u64) (__builtin_popcountll(E[i] & col) & 1)) << i;
+	return x;
+}
+
 /* The input rows are known to span a vector space of dimension less than d.
    There are 64 input rows and m input columns.
    Returns j such that columns [0:j] are echelonized.
-   rows [j+1:64] are zero. */
-u32 echelonize(u64 *T, u32 m, u32 w, u32 d, u64 *E)
+   rows [j+1:64] are zero. Random column swaps draw from the private state rng.
+
+   All the pivots are in the first 64 columns, i.e. in the first word of each
+   row. The elimination is done on this word only, while E records the row
+   operations; they are applied to the full rows at the end by m4ri_apply(). */
+u32 echelonize(u64 *T, u32 m, u32 w, u32 d, u64 *E, unsigned short *rng)
 {
 	/* E is the change of basis matrix */
-	for (u32 i = 0; i < 64; i++)
+	u64 W[64];
+	for (u32 i = 0; i < 64; i++) {
 		E[i] = 1ull << i;     /* E == identity */
-
-	// printf("Echelonize with m=%d, d=%d\n", m, d);
+		W[i] = T[i * w];
+	}
 
 	u32 n_random_trials = 6;
-	for (u32 j = 0; j < d; j++) {
+	u32 j;
+	for (j = 0; j < d; j++) {
 		/* eliminate the j-th column */
 		u32 l = j + 1;
 
-		// printf("j = %d\n", j);
-
 		/* search a row with a non-zero coeff ---> it will be the pivot */
 		i32 i = -1;
 		u64 mask = 1ull << j;
 		while (1) {
-			for (i32 k = j; k < 64; k++) {
-				// printf("Examining row %d\n", k);
-				if (((T[k * w] & mask) != 0)) {
+			for (i32 k = j; k < 64; k++)
+				if ((W[k] & mask) != 0) {
 					i = k;
-					// printf("found i = %d. %016" PRIx64 "\n", i, T[i * w]);
 					break;
 				}
-			}
 			if (i >= 0)
 				break;    /* found pivot */
 
-
 			/* pivot not found. This means that the d first columns
-			   are linearly dependent. We swap the j-th column with the o-th. */
-			i32 o;
+			   are linearly dependent. We swap the j-th column with the o-th.
+			   Column swaps commute with the row operations, so they are
+			   done on the original rows. */
+			u32 o;
 			if ((n_random_trials > 0) && (j + 1 < m)) {
-				o = (j + 1) + (lrand48() % (m - (j + 1)));
+				o = (j + 1) + (nrand48(rng) % (m - (j + 1)));
 				n_random_trials--;
 			} else {
 				if (l >= m)
@@ -301,36 +410,159 @@ u32 echelonize(u64 *T, u32 m, u32 w, u32 d, u64 *E)
 				o = l;
 				l++;
 			}
-			swap_columns(T, w, j, o);
+			if (o < 64) {
+				swap_columns(T, w, j, o);
+				for (u32 k = 0; k < 64; k++) {
+					u64 delta = ((W[k] >> j) ^ (W[k] >> o)) & 1;
+					W[k] ^= (delta << j) | (delta << o);
+				}
+			} else {
+				/* the o-th column of E * T. If it has no pivot either,
+				   don't bother swapping it in. */
+				u64 col = get_column(T, w, o);
+				u64 x = apply_column(E, col, j, 64);
+				if (x == 0)
+					continue;
+				x |= apply_column(E, col, 0, j);
+				swap_columns(T, w, j, o);
+				for (u32 k = 0; k < 64; k++)
+					W[k] = (W[k] & ~mask) | (((x >> k) & 1) << j);
+			}
 		}
 		if (i < 0)
-			return j;
+			break;
 
 		/* permute the rows so that the pivot is on the diagonal */
 		if (j != (u32) i) {
 			swap(E, i, j);
-			for (u32 k = 0; k < w; k++)
-				swap(T, i * w + k, j * w + k);
+			swap(W, i, j);
 		}
 
 		/* use the pivot to eliminate everything else on the column */
-		// trick to avoid testing if k != j
-		assert((T[j * w] & mask) != 0);
-		u64 old = T[j * w];
-		T[j * w] ^= mask;
-		assert((T[j * w] & mask) == 0);
+		u64 pivot = W[j];
+		u64 e = E[j];
 		for (u32 k = 0; k < 64; k++) {
-			if ((T[k * w] & mask) != 0) {
-				E[k] ^= E[j];         /* record the operation */
-				T[k * w] ^= old;
-				for (u32 l = 1; l < w; l++)
-					T[k * w + l] ^= T[j * w + l];
+			u64 f = -(u64) ((k != j) & (W[k] >> j) & 1);
+			W[k] ^= pivot & f;
+			E[k] ^= e & f;
+		}
+	}
+	m4ri_apply(T, w, E);
+	return j;
+}
+
+/* Incremental search (Canteaut-Chabaud): once T is in systematic form on an
+   information set of d columns, each step swaps a single column in and out of
+   the information set, with one pivot operation. */
+enum isd_strategy_t { ISD_LEE_BRICKELL, ISD_CANTEAUT_CHABAUD };
+static enum isd_strategy_t isd_strategy = ISD_LEE_BRICKELL;
+
+struct incremental_t {
+	u64 *info;          /* bitmap of the columns in the information set */
+	u32 pivot[64];      /* pivot[r] is the column of the information set with a 1 on row r */
+};
+
+/* right after echelonize(), the information set is [0:d] */
+static void incremental_setup(struct incremental_t *S, u32 w, u32 d)
+{
+	memset(S->info, 0, w * sizeof(*S->info));
+	for (u32 r = 0; r < d; r++) {
+		S->info[0] |= 1ull << r;
+		S->pivot[r] = r;
+	}
+}
+
+/* Returns false if no column could enter the information set. Otherwise,
+   *changed gives the rows of T that have been modified. */
+static bool incremental_step(u64 *T, u32 m, u32 w, u32 d, u64 *E, struct incremental_t *S,
+			     unsigned short *rng, u64 *changed)
+{
+	for (u32 trials = 0; trials < 64; trials++) {
+		u32 b = nrand48(rng) % m;
+		u32 bw = b / 64;
+		u32 bbit = b % 64;
+		if ((S->info[bw] >> bbit) & 1)
+			continue;
+		u64 col = 0;
+		for (u32 r = 0; r < d; r++)
+			col |= ((T[r * w + bw] >> bbit) & 1) << r;
+		if (col == 0)
+			continue;
+
+		/* pick a random row with a 1 in column b */
+		u64 x = col;
+		for (u32 c = nrand48(rng) % __builtin_popcountll(col); c > 0; c--)
+			x &= x - 1;
+		u32 a = __builtin_ctzll(x);
+
+		/* column b enters the information set, pivot[a] leaves it */
+		u64 rows = col ^ (1ull << a);
+		for (u64 y = rows; y != 0; y &= y - 1) {
+			u32 r = __builtin_ctzll(y);
+			E[r] ^= E[a];
+			for (u32 l = 0; l < w; l++)
+				T[r * w + l] ^= T[a * w + l];
+		}
+		u32 o = S->pivot[a];
+		S->info[o / 64] ^= 1ull << (o % 64);
+		S->info[bw] |= 1ull << bbit;
+		S->pivot[a] = b;
+		*changed = rows;
+		return true;
+	}
+	return false;
+}
+
+/* Stern/Dumer-style collision search: besides the rows of T, look at the sums
+   of two rows that vanish on a window of STERN_BITS columns. The d rows are
+   bucketed on the window, and only colliding pairs are fully evaluated. At least
+   one row of each pair must be in changed. Updates (*weight, *equation) if a
+   pair of weight less than *weight is found. */
+#define STERN_BITS 6
+static bool stern = false;
+
+static void stern_search(const u64 *T, u32 m, u32 w, u32 d, const u64 *E, const u64 *info,
+			 u64 changed, unsigned short *rng, u32 *weight, u64 *equation)
+{
+	/* the window is made of random columns outside the information set: on
+	   the information set, every row has a single 1, so no pair would vanish */
+	if (m - d < STERN_BITS)
+		return;
+	u32 window[STERN_BITS];
+	for (u32 k = 0; k < STERN_BITS; k++) {
+		u32 b;
+		bool taken;
+		do {
+			b = nrand48(rng) % m;
+			taken = (info[b / 64] >> (b % 64)) & 1;
+			for (u32 l = 0; l < k; l++)
+				taken |= (window[l] == b);
+		} while (taken);
+		window[k] = b;
+	}
+
+	i8 head[1 << STERN_BITS];
+	i8 next[64];
+	for (u32 h = 0; h < (1 << STERN_BITS); h++)
+		head[h] = -1;
+	for (u32 i = 0; i < d; i++) {
+		u32 h = 0;
+		for (u32 k = 0; k < STERN_BITS; k++)
+			h |= ((T[i * w + window[k] / 64] >> (window[k] % 64)) & 1) << k;
+		for (i32 j = head[h]; j >= 0; j = next[j]) {
+			if ((((changed >> i) | (changed >> j)) & 1) == 0)
+				continue;
+			u32 x = 0;
+			for (u32 l = 0; l < w && x < *weight; l++)
+				x += __builtin_popcountll(T[i * w + l] ^ T[j * w + l]);
+			if (x < *weight) {
+				*weight = x;
+				*equation = E[i] ^ E[j];
 			}
 		}
-		T[j * w] ^= mask;
-		assert((T[j * w] & mask) != 0);
+		next[i] = head[h];
+		head[h] = i;
 	}
-	return d;
 }
 
 /* If the columns of M span a vector space of dimension less than 64 - k, then
@@ -343,9 +575,10 @@ u32 check_rank_defect(const u64 *M, u32 m, u64 *equations, int k) {
 	u64 E[64];
 	u64 T[rows];
 	u32 d = 64 - k;
+	unsigned short rng[3] = {lrand48(), lrand48(), lrand48()};
 	transpose(M, w, T);
 
-	u32 j = echelonize(T, m, w, d, E);
+	u32 j = echelonize(T, m, w, d, E, rng);
 	if (j == d)
 		return k;
 
@@ -437,11 +670,8 @@ int slice_it(u32 l, u64 *equations, double T)
 		u64 *M = malloc(rows * sizeof(*M));
 		if (M == NULL)
 			err(1, "cannot allocate scratch space");
-		u32 i = 0;
-		for (struct list_t *item = active->next; item != active; item = item->next)
-			M[i++] = item->x;
-		while (i < rows)
-			M[i++] = 0x0000000;
+		memcpy(M, vectors, m * sizeof(*M));
+		memset(M + m, 0, (rows - m) * sizeof(*M));
 
 		k = check_rank_defect(M, m, equations, k);
 		if (k >= l)
@@ -458,56 +688,106 @@ int slice_it(u32 l, u64 *equations, double T)
 		else if (!QUIET)
 			printf("%d ", m);
 
-		/* setup low-weight search */
+		/* setup low-weight search. Each thread runs its own iterations of the
+		   Lee-Brickell algorithm, on a private copy of M. With the incremental
+		   strategy, only the first one starts from scratch. */
 		u32 best_weight = m;
 		u64 best_equation = 0;
-		u32 n_iterations = MAX_ISD_ITERATIONS * 150000 / m;
-
-		if (VERBOSE)
-			printf("Going for %d iterations\n", n_iterations);
-
-		u64 T[rows];
-		u64 E[64];
+		u64 n_iterations = 0;
 		double start = wtime();
 		double stop = start + timeouts[k];
-		u32 it = 0;
-		while (it == 0 || wtime() < stop) {
-			/* this is one iteration of the Lee-Brickell algorithm */
-			it++;
-
-			/* random permutation of the rows */
-			for (u32 i = 0; i < d; i++) {
-				u32 j = i + (lrand48() % (m - i));
-				swap(M, i, j);
+
+		#pragma omp parallel reduction(+:n_iterations)
+		{
+			unsigned short rng[3];
+			#pragma omp critical(slicer_rng)
+			{
+				for (u32 i = 0; i < 3; i++)
+					rng[i] = lrand48();
 			}
+			u64 *Mt = malloc(rows * sizeof(*Mt));
+			u64 *T = malloc(rows * sizeof(*T));
+			struct incremental_t S;
+			S.info = malloc(w * sizeof(*S.info));
+			if (Mt == NULL || T == NULL || S.info == NULL)
+				err(1, "cannot allocate scratch space");
+			memcpy(Mt, M, rows * sizeof(*Mt));
+			u64 E[64];
+
+			u32 it = 0;
+			bool systematic = false;    /* T is ready for incremental_step() */
+			while (it == 0 || wtime() < stop) {
+				it++;
+				u64 changed = 0;
+				if (systematic)
+					systematic = incremental_step(T, m, w, d, E, &S, rng, &changed);
+				if (!systematic) {
+					/* this is one iteration of the Lee-Brickell algorithm */
+
+					/* random permutation of the rows */
+					for (u32 i = 0; i < d; i++) {
+						u32 j = i + (nrand48(rng) % (m - i));
+						swap(Mt, i, j);
+					}
+
+					/* transpose the matrix, in order to access the columns efficiently */
+					transpose(Mt, w, T);
+
+					u32 j = echelonize(T, m, w, d, E, rng);
+					assert(j == d);
+					changed = (d < 64) ? (1ull << d) - 1 : ~0ull;
+
+					/* S.info is also needed by stern_search() */
+					incremental_setup(&S, w, d);
+					systematic = (isd_strategy == ISD_CANTEAUT_CHABAUD);
+				}
 
-			/* transpose the matrix, in order to access the columns efficiently */
-			transpose(M, w, T);
-
-			u32 j = echelonize(T, m, w, d, E);
-			assert(j == d);
-
-			/* look for a low-weight row */
-			for (u32 i = 0; i < 64 - k; i++) {
-				u32 weight = 0;
-				for (u32 l = 0; l < w; l++)
-					weight += __builtin_popcountll(T[i * w + l]);
-				if (weight < best_weight) {
-					if (VERBOSE)
-						printf("\rw = %d (%d iterations)", weight, it);
-					best_weight = weight;
-					best_equation = E[i];
+				/* look for a low-weight row among those that changed */
+				u32 current;
+				#pragma omp atomic read
+				current = best_weight;
+				u32 weight = current;
+				u64 equation = 0;
+				for (u64 y = changed; y != 0; y &= y - 1) {
+					u32 i = __builtin_ctzll(y);
+					u32 x = 0;
+					for (u32 l = 0; l < w; l++)
+						x += __builtin_popcountll(T[i * w + l]);
+					if (x < weight) {
+						weight = x;
+						equation = E[i];
+					}
+				}
+				if (stern)
+					stern_search(T, m, w, d, E, S.info, changed, rng, &weight, &equation);
+				if (weight < current) {
+					#pragma omp critical(slicer_best)
+					{
+						if (weight < best_weight) {
+							if (VERBOSE)
+								printf("\rw = %d (%d iterations)", weight, it);
+							#pragma omp atomic write
+							best_weight = weight;
+							best_equation = equation;
+						}
+						current = best_weight;
+					}
+				}
+				if (current < expected_w) {
+					// printf("\nweight small enough; early abort\n");
+					break;
 				}
 			}
-			if (best_weight < expected_w) {
-				// printf("\nweight small enough; early abort\n");
-				break;
-			}
+			n_iterations += it;
+			free(S.info);
+			free(T);
+			free(Mt);
 		}
-		filter_active(best_equation);
+		filter_active(best_equation, M);
 		equations[k++] = best_equation;
 		if (VERBOSE) {
-			printf("\nBest weight=%d, equation=%" PRIx64 "\n", best_weight, best_equation);
+			printf("\nBest weight=%d, equation=%" PRIx64 " (%" PRIu64 " iterations, %.0f it/s)\n",
+				best_weight, best_equation, n_iterations, n_iterations / (wtime() - start));
 			printf("Done an ISD pass. I now have %d equations and %d active vectors\n", k, m);
 		}
 		free(M);
@@ -527,6 +807,8 @@ void usage()
 	printf("Slice all hash files:\n");
 	printf("	./slicer [--l INT] [--output-dir PATH] [--input-dir PATH] [--partitioning-bits INT]\n");
 	printf("\n\nThe --l parameter default to 19\n");
+	printf("The --isd parameter is either lee-brickell (default) or canteaut-chabaud\n");
+	printf("--stern also looks for sums of two rows (collisions on a window)\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -536,13 +818,15 @@ int main(int argc, char **argv)
 	int rank, size;
 
 	/* process command-line options */
-	struct option longopts[7] = {
+	struct option longopts[9] = {
 		{"output", required_argument, NULL, 't'},
 		{"output-dir", required_argument, NULL, 'o'},
 		{"input-dir", required_argument, NULL, 'i'},
 		{"partitioning-bits", required_argument, NULL, 'b'},
 		{"l", required_argument, NULL, 'l'},
 		{"time-control", required_argument, NULL, 'c'},
+		{"isd", required_argument, NULL, 's'},
+		{"stern", no_argument, NULL, 'p'},
 		{NULL, 0, NULL, 0}
 	};
 	char *target = NULL;
@@ -578,6 +862,17 @@ int main(int argc, char **argv)
 		case 'c':
 			remaining_time = atof(optarg);   // in HOURS
 			break;
+		case 's':
+			if (strcmp(optarg, "lee-brickell") == 0)
+				isd_strategy = ISD_LEE_BRICKELL;
+			else if (strcmp(optarg, "canteaut-chabaud") == 0)
+				isd_strategy = ISD_CANTEAUT_CHABAUD;
+			else
+				errx(1, "unknown ISD strategy %s", optarg);
+			break;
+		case 'p':
+			stern = true;
+			break;
 		default:
 			errx(1, "Unknown option\n");
 		}
@@ -620,31 +915,17 @@ int main(int argc, char **argv)
 			err(1, "cannot allocate filenames");
 	}
 
+	setup_engines();
+
 	u64 n;
-	u64 *L = load(in_filename, &n);
+	vectors = load(in_filename, &n);
+	u64 *L = vectors;
 
 	FILE *f_out = fopen(target, "w");
 	if (f_out == NULL)
 		err(1, "cannot open %s\n", target);
 
-	/* setup doubly-linked lists with dummy node */
-	struct list_t *items = malloc(n * sizeof(*items));
-	if ((items == NULL))
-		err(1, "cannot allocate linked lists");
-	struct list_t active_header, reject_header;
-	active = &active_header;
-	reject = &reject_header;
-	active->x = 0x00000000;
-	reject->x = 0x00000000;
-	list_clear(active);
-	list_clear(reject);
-
 	/* setup: all vectors are "active" */
-	for (u32 i = 0; i < n; i++) {
-		items[i].x = L[i];
-		list_insert(active, &items[i]);
-	}
-	free(L);
 	m = n;         // count of active vectors
 
 	u64 output_size = sizeof(struct slice_t) / 8 * (1 + n / (64 - l)) + n;
@@ -687,6 +968,7 @@ int main(int argc, char **argv)
 
 		slice->n = m;
 		slice->l = k;
+		u64 SM[64], SMinv[64];    /* slice_t is packed: work on aligned copies */
 		bool ok = false;
 		int n_trials = 0;
 		while (!ok) {
@@ -696,8 +978,8 @@ int main(int argc, char **argv)
 			for (u32 i = 0; i < k; i++)
 				T[64 - k + i] = equations[i];
 
-			transpose_64(T, slice->M);
-			ok = invert(slice->M, slice->Minv);
+			transpose_64(T, SM);
+			ok = invert(SM, SMinv);
 			n_trials++;
 
 			if (n_trials > 1000) {
@@ -707,21 +989,22 @@ int main(int argc, char **argv)
 			}
 		}
 
-		u32 i = 0;
-		for (struct list_t *item = active->next; item != active; item = item->next)
-			slice->CM[i++] = naive_gemv(item->x, slice->M);
+		memcpy(slice->M, SM, sizeof(SM));
+		memcpy(slice->Minv, SMinv, sizeof(SMinv));
+
+		for (u32 i = 0; i < m; i++)
+			slice->CM[i] = naive_gemv(vectors[i], SM);
 
 		/* The active (=good) vectors are discarded. The rejected vectors become active again for the next pass. */
-		struct list_t *tmp = active;
-		active = reject;
-		reject = tmp;
-		list_clear(reject);
+		vectors += m;
 		vectors_done += m;
 		slices_done++;
 		n -= m;
 		m = n;
 	}
 
+	free(L);
+
 	if (!QUIET && multi_mode)
 		printf("Process %d, writing\n", rank);
 